@@ -68,9 +68,19 @@ void array_append_data(array_p *array_ptr, size_t sz, tree_p *data)
         }
         result->length += sz;
     }
-    array_unref(array);
-    if (result != array)
-        array_set(array_ptr, result);
+
+    // Release the reference taken above, which moved with the tree
+    if (in_place && result)
+    {
+        array_unref(result);
+        *array_ptr = result;
+    }
+    else
+    {
+        array_unref(array);
+        if (result && result != array)
+            array_set(array_ptr, result);
+    }
 }
 
 
@@ -112,17 +122,23 @@ void array_range(array_p *array_ptr, size_t first, size_t length)
     {
         // In_Place data and incrementits reference count
         for (size_t i = 0; i < resized; i++)
-            tree_set(&dst_data[i], (tree_p) src_data[i]);
+            dst_data[i] = tree_use((tree_p) src_data[i]);
     }
-    in_place->length = resized;
     if (in_place == array)
     {
         // We did the in_place in place: need to truncate result
+        // The length is updated after realloc, which charges the old size
         in_place = (array_p) tree_realloc((tree_p) in_place, resized_bytes);
+        in_place->length = resized;
+        array_unref(in_place);
+        *array_ptr = in_place;
     }
-    array_unref(array);
-    if (in_place != array)
+    else
+    {
+        in_place->length = resized;
+        array_unref(array);
         array_set(array_ptr, in_place);
+    }
 }
 
 
@@ -0,0 +1,484 @@
+// ****************************************************************************
+//  bench_scanner.c                                 XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Measure the throughput of the scanner on synthetic and real input
+//
+//     Each corpus is scanned with scanner_read until it has been read for
+//     long enough to give a stable measurement. Comments and long texts are
+//     skipped with scanner_skip, as the parser does. The results are given
+//     in MB/s, tokens/s, and tree allocations per token.
+//
+//     Usage: bench_scanner [-size MB] [-time S] [-syntax FILE] [files...]
+//     Files given on the command line are measured together, as one corpus.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "error.h"
+#include "name.h"
+#include "position.h"
+#include "recorder.h"
+#include "scanner.h"
+#include "syntax.h"
+#include "text.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef PREFIX_PATH
+#define PREFIX_PATH     ""
+#endif
+
+RECORDER(BENCH, 32, "Scanner benchmark");
+
+
+
+// ============================================================================
+//
+//    Synthetic corpora
+//
+// ============================================================================
+//   Generators write random but reproducible source code until the output
+//   reaches the requested size. Each stresses one path of the scanner.
+
+typedef void (*bench_generator_fn)(FILE *out, size_t size);
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ull;
+
+
+static unsigned bench_random(unsigned range)
+// ----------------------------------------------------------------------------
+//   Return a pseudo-random number in 0..range-1 (xorshift)
+// ----------------------------------------------------------------------------
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed % range;
+}
+
+
+static void bench_name(FILE *out)
+// ----------------------------------------------------------------------------
+//   Emit a random name, sometimes with underscores or UTF-8
+// ----------------------------------------------------------------------------
+{
+    static const char *parts[] =
+    {
+        "alpha", "Beta", "gamma", "delta", "x", "y", "index", "Count",
+        "value", "total", "élan", "größe", "list", "node", "k9", "tmp"
+    };
+    unsigned count = 1 + bench_random(3);
+    for (unsigned p = 0; p < count; p++)
+    {
+        if (p)
+            fputc('_', out);
+        fputs(parts[bench_random(sizeof(parts) / sizeof(*parts))], out);
+    }
+}
+
+
+static void bench_identifiers(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Mostly names separated by spaces, as in long prefix applications
+// ----------------------------------------------------------------------------
+{
+    while ((size_t) ftell(out) < size)
+    {
+        unsigned words = 4 + bench_random(12);
+        for (unsigned w = 0; w < words; w++)
+        {
+            if (w)
+                fputc(' ', out);
+            bench_name(out);
+        }
+        fputc('\n', out);
+    }
+}
+
+
+static void bench_operators(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Short names and numbers separated by operators and parentheses
+// ----------------------------------------------------------------------------
+{
+    static const char *operators[] =
+    {
+        "+", "-", "*", "/", "=", "<>", "<=", ">=", "..", ":=", "->",
+        "and", "or", "^", "&", "|", ".", "mod"
+    };
+    while ((size_t) ftell(out) < size)
+    {
+        unsigned terms = 3 + bench_random(10);
+        unsigned open = 0;
+        fprintf(out, "%c := ", 'a' + bench_random(26));
+        for (unsigned t = 0; t < terms; t++)
+        {
+            if (t)
+                fprintf(out, "%s", operators[bench_random(sizeof(operators) /
+                                                          sizeof(*operators))]);
+            if (bench_random(4) == 0)
+            {
+                fputc('(', out);
+                open++;
+            }
+            if (bench_random(2))
+                fprintf(out, "%c", 'a' + bench_random(26));
+            else
+                fprintf(out, "%u", bench_random(1000));
+            if (open && bench_random(3) == 0)
+            {
+                fputc(')', out);
+                open--;
+            }
+        }
+        while (open--)
+            fputc(')', out);
+        fputc('\n', out);
+    }
+}
+
+
+static void bench_indented(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Deeply nested blocks, to exercise indent and unindent tokens
+// ----------------------------------------------------------------------------
+{
+    unsigned depth = 0;
+    while ((size_t) ftell(out) < size)
+    {
+        fprintf(out, "%*s", 4 * depth, "");
+        if (depth < 40 && bench_random(3))
+        {
+            fprintf(out, "if x%u then\n", depth);
+            depth++;
+        }
+        else
+        {
+            fprintf(out, "y%u := %u\n", depth, bench_random(100));
+            if (depth && bench_random(2))
+                depth -= 1 + bench_random(depth);
+        }
+    }
+    fputc('\n', out);
+}
+
+
+static void bench_comments(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Long line and block comments between short statements
+// ----------------------------------------------------------------------------
+{
+    while ((size_t) ftell(out) < size)
+    {
+        unsigned length = 40 + bench_random(400);
+        bool block = bench_random(2);
+        fputs(block ? "/* " : "// ", out);
+        for (unsigned c = 0; c < length; c++)
+        {
+            fputc(c % 7 == 6 ? ' ' : 'a' + bench_random(26), out);
+            if (block && c % 80 == 79)
+                fputc('\n', out);
+        }
+        fputs(block ? " */\n" : "\n", out);
+        fputs("x := 1\n", out);
+    }
+}
+
+
+static void bench_texts(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Long quoted texts, some with doubled quotes, and long << >> texts
+// ----------------------------------------------------------------------------
+{
+    while ((size_t) ftell(out) < size)
+    {
+        unsigned length = 100 + bench_random(4000);
+        unsigned kind = bench_random(3);
+        fputs(kind == 2 ? "t := <<" : "t := \"", out);
+        for (unsigned c = 0; c < length; c++)
+        {
+            if (kind == 1 && c % 200 == 100)
+                fputs("\"\"", out);
+            else if (kind == 2 && c % 100 == 99)
+                fputc('\n', out);
+            else
+                fputc(c % 9 == 8 ? ' ' : 'a' + bench_random(26), out);
+        }
+        fputs(kind == 2 ? ">>\n" : "\"\n", out);
+    }
+}
+
+
+static void bench_blobs(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Large hexadecimal and base-64 blobs
+// ----------------------------------------------------------------------------
+{
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    while ((size_t) ftell(out) < size)
+    {
+        unsigned length = 1000 + bench_random(16000);
+        bool hex = bench_random(2);
+        fputs(hex ? "b := $" : "b := $64#", out);
+        for (unsigned c = 0; c < length; c++)
+        {
+            if (hex)
+                fputc("0123456789ABCDEF"[bench_random(16)], out);
+            else
+                fputc(base64[bench_random(64)], out);
+            if (hex && c % 64 == 63)
+                fputc(' ', out);
+        }
+        fputs("$\n", out);
+    }
+}
+
+
+static void bench_numbers(FILE *out, size_t size)
+// ----------------------------------------------------------------------------
+//   Tables of integers, reals and based numbers
+// ----------------------------------------------------------------------------
+{
+    while ((size_t) ftell(out) < size)
+    {
+        for (unsigned column = 0; column < 8; column++)
+        {
+            switch(bench_random(5))
+            {
+            case 0:
+                fprintf(out, "%u", bench_random(1000000));
+                break;
+            case 1:
+                fprintf(out, "%u.%03u", bench_random(10000), bench_random(1000));
+                break;
+            case 2:
+                fprintf(out, "%u.%ue%d", bench_random(10), bench_random(100),
+                        (int) bench_random(40) - 20);
+                break;
+            case 3:
+                fprintf(out, "16#%X", bench_random(1u << 30));
+                break;
+            default:
+                fprintf(out, "1_%03u_%03u", bench_random(1000),
+                        bench_random(1000));
+                break;
+            }
+            fputs(column < 7 ? ", " : "\n", out);
+        }
+    }
+}
+
+
+typedef struct bench_corpus
+// ----------------------------------------------------------------------------
+//   A synthetic corpus
+// ----------------------------------------------------------------------------
+{
+    const char *        name;
+    bench_generator_fn  generate;
+} bench_corpus_t;
+
+static const bench_corpus_t bench_corpora[] =
+{
+    { "identifiers",    bench_identifiers },
+    { "operators",      bench_operators },
+    { "indented",       bench_indented },
+    { "comments",       bench_comments },
+    { "texts",          bench_texts },
+    { "blobs",          bench_blobs },
+    { "numbers",        bench_numbers },
+};
+
+
+
+// ============================================================================
+//
+//    Measurements
+//
+// ============================================================================
+
+typedef struct bench_result
+// ----------------------------------------------------------------------------
+//   Totals accumulated while scanning a corpus
+// ----------------------------------------------------------------------------
+{
+    double      seconds;        // Time spent scanning
+    size_t      bytes;          // Bytes of input scanned
+    size_t      tokens;         // Tokens returned by scanner_read
+    size_t      allocations;    // Tree allocations while scanning
+    unsigned    errors;         // Errors reported by the scanner
+} bench_result_t, *bench_result_p;
+
+
+static double bench_now(void)
+// ----------------------------------------------------------------------------
+//   Return a monotonic time in seconds
+// ----------------------------------------------------------------------------
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static bool bench_scan(scanner_p s, const char *file, bench_result_p result)
+// ----------------------------------------------------------------------------
+//   Scan one file to the end, and add the measurements to result
+// ----------------------------------------------------------------------------
+{
+    tree_budget_t budget = { 0 };
+    tree_budget_p outer = tree_set_budget(&budget);
+    size_t tokens = 0;
+    name_p closing = NULL;
+
+    double start = bench_now();
+    FILE *f = scanner_open(s, file);
+    if (!f)
+    {
+        tree_set_budget(outer);
+        return false;
+    }
+    for (token_t t = scanner_read(s); t != tokEOF; t = scanner_read(s))
+    {
+        tokens++;
+
+        // Like the parser, skip comments and long texts after their opening
+        if ((t == tokNAME || t == tokSYMBOL) &&
+            (syntax_is_comment(s->syntax, s->scanned.name, &closing) ||
+             syntax_is_text(s->syntax, s->scanned.name, &closing)))
+        {
+            text_p skipped = text_use(scanner_skip(s, closing));
+            text_dispose(&skipped);
+        }
+    }
+    name_dispose(&closing);
+    long bytes = ftell(f);
+    scanner_close(s, f);
+    double seconds = bench_now() - start;
+
+    tree_set_budget(outer);
+    result->seconds += seconds;
+    result->bytes += bytes > 0 ? bytes : 0;
+    result->tokens += tokens + 1;
+    result->allocations += budget.allocations;
+    return true;
+}
+
+
+static void bench_run(const char *name, syntax_p syntax,
+                      int count, char **files, double duration)
+// ----------------------------------------------------------------------------
+//   Scan the files repeatedly for at least the given duration, and report
+// ----------------------------------------------------------------------------
+{
+    bench_result_t result = { 0 };
+    positions_p positions = positions_new();
+    positions_p outer = error_set_positions(positions);
+    scanner_p s = scanner_new(positions, syntax);
+    unsigned runs = 0;
+
+    errors_mute(true);
+    do
+    {
+        for (int f = 0; f < count; f++)
+        {
+            if (!bench_scan(s, files[f], &result))
+            {
+                fprintf(stderr, "Cannot open '%s'\n", files[f]);
+                count = 0;
+            }
+        }
+        runs++;
+    } while (count && result.seconds < duration);
+    result.errors = errors_mute(false) / runs;
+
+    scanner_delete(s);
+    error_set_positions(outer);
+    positions_delete(positions);
+
+    RECORD(BENCH, "%s: %u runs, %zu bytes, %zu tokens",
+           name, runs, result.bytes, result.tokens);
+    if (!result.tokens)
+        return;
+    printf("%-16s %8.2f MB %6u %10.1f %12.0f %10.3f",
+           name, result.bytes / runs / 1e6, runs,
+           result.bytes / result.seconds / 1e6,
+           result.tokens / result.seconds,
+           (double) result.allocations / result.tokens);
+    if (result.errors)
+        printf("   (%u errors)", result.errors);
+    printf("\n");
+}
+
+
+
+// ============================================================================
+//
+//    Main entry point
+//
+// ============================================================================
+
+int main(int argc, char *argv[])
+// ----------------------------------------------------------------------------
+//   Generate and measure each corpus, then measure files given as arguments
+// ----------------------------------------------------------------------------
+{
+    const char *syntax_file = PREFIX_PATH "xl.syntax";
+    double      size        = 8;
+    double      duration    = 1;
+    int         arg;
+
+    recorder_dump_on_common_signals(0,0);
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "-size") == 0 && arg + 1 < argc)
+            size = atof(argv[++arg]);
+        else if (strcmp(argv[arg], "-time") == 0 && arg + 1 < argc)
+            duration = atof(argv[++arg]);
+        else if (strcmp(argv[arg], "-syntax") == 0 && arg + 1 < argc)
+            syntax_file = argv[++arg];
+        else
+            break;
+    }
+
+    syntax_p syntax = syntax_use(syntax_new(syntax_file));
+    printf("%-16s %11s %6s %10s %12s %10s\n",
+           "Corpus", "Size", "Runs", "MB/s", "Tokens/s", "Allocs/tok");
+
+    for (size_t c = 0; c < sizeof(bench_corpora)/sizeof(*bench_corpora); c++)
+    {
+        const bench_corpus_t *corpus = &bench_corpora[c];
+        char file[] = "/tmp/bench_scanner_XXXXXX";
+        int fd = mkstemp(file);
+        FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!out)
+        {
+            perror("Cannot create corpus file");
+            return 1;
+        }
+        corpus->generate(out, size * 1e6);
+        fclose(out);
+
+        char *files[] = { file };
+        bench_run(corpus->name, syntax, 1, files, duration);
+        unlink(file);
+    }
+
+    if (arg < argc)
+        bench_run("files", syntax, argc - arg, argv + arg, duration);
+
+    syntax_dispose(&syntax);
+    return 0;
+}
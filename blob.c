@@ -38,6 +38,7 @@ void blob_append_data(blob_p *blob_ptr, size_t sz, const char *data)
 {
     blob_p blob = *blob_ptr;
     blob_p in_place = blob;
+    blob_data(blob);            // Copy lazy data before moving the blob
     if (blob_ref(blob))
         in_place = NULL;
     size_t old_size = sizeof(blob_t) + blob->length;
@@ -50,19 +51,24 @@ void blob_append_data(blob_p *blob_ptr, size_t sz, const char *data)
             memcpy(result, blob, old_size);
             result->tree.refcount = 0;
         }
-        char *append_dst = blob_data(result) + blob_length(blob);
+        char *append_dst = (char *) result + old_size;
         if (data)
             memcpy(append_dst, data, sz);
         else
             memset(append_dst, 0, sz);
         result->length += sz;
     }
-    blob_unref(blob);
-    if (result != blob)
+
+    // Release the reference taken above, which moved with the tree
+    if (in_place && result)
     {
-        if (in_place)
-            *blob_ptr = result;
-        else
+        blob_unref(result);
+        *blob_ptr = result;
+    }
+    else
+    {
+        blob_unref(blob);
+        if (result && result != blob)
             blob_set(blob_ptr, result);
     }
 }
@@ -76,6 +82,7 @@ void blob_range(blob_p *blob_ptr, size_t first, size_t length)
 {
     blob_p blob = *blob_ptr;
     blob_p in_place = blob;
+    blob_data(blob);            // Copy lazy data before moving the blob
     size_t end = first + length;
     if (end > blob->length)
         end = blob->length;
@@ -89,14 +96,61 @@ void blob_range(blob_p *blob_ptr, size_t first, size_t length)
         in_place->tree.refcount = 0;
     }
     memmove(in_place + 1, blob_data(blob) + first, resized);
-    in_place->length = resized;
     if (in_place == blob)
+    {
+        // Update the length after realloc, which charges the old size
         in_place = (blob_p) tree_realloc((tree_p) in_place,
                                          sizeof(blob_t) + resized);
-    blob_unref(blob);
-
-    if (in_place != blob)
+        in_place->length = resized;
+        blob_unref(in_place);
+        *blob_ptr = in_place;
+    }
+    else
+    {
+        in_place->length = resized;
+        blob_unref(blob);
         blob_set(blob_ptr, in_place);
+    }
+}
+
+
+blob_p blob_make_lazy(tree_handler_fn h, srcpos_t pos,
+                      size_t sz, const char *data)
+// ----------------------------------------------------------------------------
+//   Create a blob that will copy the given data only when first accessed
+// ----------------------------------------------------------------------------
+//   The data must remain valid until then, e.g. because it is in a source
+//   file mapped by the positions. It is not copied, but its address is
+//   kept at the beginning of the storage allocated for it, which large
+//   allocations leave untouched until blob_data is called.
+//   Blobs too small to hold the address are copied immediately.
+{
+    if (sz < sizeof(data))
+        return blob_make(h, pos, sz, data);
+
+    blob_p blob = (blob_p) tree_malloc_raw(sizeof(blob_t) + sz);
+    blob->tree.handler = h;
+    blob->tree.refcount = 0;
+    blob->tree.position = pos;
+    blob->length = sz | BLOB_LAZY;
+    memcpy(blob + 1, &data, sizeof(data));
+    return blob;
+}
+
+
+char *blob_materialize(blob_p blob)
+// ----------------------------------------------------------------------------
+//   Copy the data of a lazy blob in place
+// ----------------------------------------------------------------------------
+//   This modifies the blob, so a blob that other threads may read must be
+//   materialized before it is shared with them (see epoch_share).
+{
+    const char *data;
+    char *copy = (char *) (blob + 1);
+    memcpy(&data, copy, sizeof(data));
+    blob->length &= ~BLOB_LAZY;
+    memcpy(copy, data, blob->length);
+    return copy;
 }
 
 
@@ -105,6 +159,8 @@ int blob_compare(blob_p b1, blob_p b2)
 //   Compare two blobs (lexical order)
 // ----------------------------------------------------------------------------
 {
+    if (b1 == b2)
+        return 0;
     char *  p1  = blob_data(b1);
     char *  p2  = blob_data(b2);
     size_t  l1  = blob_length(b1);
@@ -141,7 +197,7 @@ tree_p blob_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     case TREE_SIZE:
         // Return the size of the tree in bytes (is dynamic for blobs)
-        return (tree_p) (sizeof(blob_t) + blob->length);
+        return (tree_p) (sizeof(blob_t) + blob_length(blob));
 
     case TREE_ARITY:
         // The arity for blobs is normally 0
@@ -174,7 +230,7 @@ tree_p blob_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         // Dump the blob as an hexadecimal string
         renderer = va_arg(va, renderer_p);
         render_text(renderer, 1, "$");
-        data = (const char *) (blob + 1);
+        data = blob_data(blob);
         for (idx = 0; idx < blob->length;idx++)
         {
             size = snprintf(buffer, sizeof(buffer), "%02X", data[idx]);
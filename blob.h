@@ -35,6 +35,9 @@ typedef struct blob
     size_t      length;         // Size in bytes of the data that follows
 } blob_t;
 
+// Lengths with this bit set are for blobs not copied yet (see blob_make_lazy)
+#define BLOB_LAZY       ((size_t) 1 << (8 * sizeof(size_t) - 1))
+
 #ifdef BLOB_C
 #define inline extern inline
 #endif
@@ -50,8 +53,17 @@ extern int      blob_compare(blob_p blob1, blob_p blob2);
 
 // Private blob handler, should not be called directly in general
 inline blob_p   blob_make(tree_handler_fn h, srcpos_t, size_t, const char *);
+extern blob_p   blob_make_lazy(tree_handler_fn h, srcpos_t, size_t, const char *);
+extern char   * blob_materialize(blob_p blob);
 extern tree_p   blob_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
+// Declare a static immortal blob-based tree initialized from a C constant
+#define blob_static(type, var, str)                                     \
+    static struct { blob_t blob; char data[sizeof(str) - 1]; }          \
+    var##_static = { { { type##_handler, TREE_IMMORTAL, 0 },            \
+                       sizeof(str) - 1 }, str };                        \
+    static type##_p const var = (type##_p) &var##_static
+
 #undef inline
 
 
@@ -94,7 +106,12 @@ inline char *blob_data(blob_p blob)
 // ----------------------------------------------------------------------------
 //   Return the data for the blob
 // ----------------------------------------------------------------------------
+//   The first call for a lazy blob copies its data into the blob. Until
+//   then, only one thread may access the blob, and the source must remain
+//   mapped. Trees returned by parser_parse no longer contain lazy blobs.
 {
+    if (blob->length & BLOB_LAZY)
+        return blob_materialize(blob);
     return (char *) (blob + 1);
 }
 
@@ -104,7 +121,7 @@ inline size_t blob_length(blob_p blob)
 //   Return the data for the blob
 // ----------------------------------------------------------------------------
 {
-    return blob->length;
+    return blob->length & ~BLOB_LAZY;
 }
 
 
@@ -132,6 +149,15 @@ inline size_t blob_length(blob_p blob)
         return (type##_p) type##_make(type##_handler, pos,sz, data);    \
     }                                                                   \
                                                                         \
+    inline type##_p type##_lazy(srcpos_t pos,                           \
+                                size_t sz, const item *data)            \
+    {                                                                   \
+        sz *= sizeof(item);                                             \
+        const char *chardata = (const char *) data;                     \
+        return (type##_p) blob_make_lazy(type##_handler, pos, sz,       \
+                                         chardata);                     \
+    }                                                                   \
+                                                                        \
     inline void type##_append(type##_p *type, type##_p type2)           \
     {                                                                   \
         blob_append((blob_p *) type, (blob_p) type2);                   \
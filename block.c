@@ -23,54 +23,90 @@
 #include "block.h"
 #include "renderer.h"
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
+
+
+static inline size_t block_bytes(size_t capacity)
+// ----------------------------------------------------------------------------
+//   Number of bytes to allocate for a block with the given capacity
+// ----------------------------------------------------------------------------
+{
+    return sizeof(block_t) + capacity * sizeof(tree_p);
+}
+
+
+static inline size_t block_grow(size_t capacity, size_t needed)
+// ----------------------------------------------------------------------------
+//   Compute a new capacity, geometrically growing past inline capacity
+// ----------------------------------------------------------------------------
+{
+    if (capacity < BLOCK_INLINE)
+        capacity = BLOCK_INLINE;
+    while (capacity < needed)
+        capacity *= 2;
+    return capacity;
+}
 
 
 void block_append_data(block_p *block_ptr, size_t sz, tree_p *data)
 // ----------------------------------------------------------------------------
 //   Append data to the block - In place if possible
 // ----------------------------------------------------------------------------
-//   This is very similar to blobs, but does ref-counting of elements
+//   This is very similar to blobs, but does ref-counting of elements.
+//   Unused slots are kept NULL, so that we only reallocate when full.
 {
     block_p block = *block_ptr;
     block_p in_place = block;
     if (block_ref(block))
         in_place = NULL;
-    size_t old_size = sizeof(block_t) + block->length * sizeof(tree_p);
-    size_t ins_size = sz * sizeof(tree_p);
-    size_t new_size = old_size + ins_size;
+    size_t length = block->length;
+    size_t capacity = block->capacity;
+    size_t needed = length + sz;
 
-    block_p result = (block_p) tree_realloc((tree_p) in_place, new_size);
-    if (result)
+    block_p result = in_place;
+    if (!in_place || needed > capacity)
     {
-        if (!in_place)
+        capacity = block_grow(capacity, needed);
+        result = (block_p) tree_realloc((tree_p) in_place,
+                                        block_bytes(capacity));
+        if (result)
         {
-            memcpy(result, block, old_size);
-            result->tree.refcount = 0;
-
-            // Since we make a new in_place, we must reference these items
-            tree_p *children = block_data(result);
-            size_t length = block_length(result);
-            for (size_t i = 0; i < length; i++)
-                tree_ref(children[i]);
+            if (!in_place)
+            {
+                memcpy(result, block, block_bytes(length));
+                result->tree.refcount = 0;
+
+                // Since we make a new block, we must reference these items
+                tree_p *children = block_data(result);
+                for (size_t i = 0; i < length; i++)
+                    tree_ref(children[i]);
+            }
+            memset(block_data(result) + length, 0,
+                   (capacity - length) * sizeof(tree_p));
+            result->capacity = capacity;
         }
-        char *append_dst = (char *) result + old_size;
+    }
+    if (result)
+    {
+        tree_p *append_dst = block_data(result) + length;
         if (data)
-        {
-            memcpy(append_dst, data, ins_size);
             for (size_t i = 0; i < sz; i++)
-                tree_ref(data[i]);
-        }
-        else
-        {
-            // Initialize with 0
-            memset(append_dst, 0, ins_size);
-        }
-        result->length += sz;
+                append_dst[i] = tree_use(data[i]);
+        result->length = needed;
+    }
+
+    // Release the reference taken above, which moved with the tree
+    if (in_place && result)
+    {
+        block_unref(result);
+        *block_ptr = result;
+    }
+    else
+    {
+        block_unref(block);
+        if (result)
+            block_set(block_ptr, result);
     }
-    block_unref(block);
-    if (result != block)
-        block_set(block_ptr, result);
 }
 
 
@@ -78,7 +114,8 @@ void block_range(block_p *block_ptr, size_t first, size_t length)
 // ----------------------------------------------------------------------------
 //   Select a range of the block, in place if possible
 // ----------------------------------------------------------------------------
-//   We can move in place if there is only one user of this block
+//   We can move in place if there is only one user of this block.
+//   The capacity of the block is not reduced.
 {
     block_p block = *block_ptr;
     block_p in_place = block;
@@ -88,12 +125,14 @@ void block_range(block_p *block_ptr, size_t first, size_t length)
     if (first > block->length)
         first = block->length;
     size_t resized = end - first;
-    size_t resized_bytes = sizeof(block_t) + resized * sizeof(tree_p);
     if (block_ref(block))
     {
-        in_place = (block_p) tree_malloc(resized_bytes);
+        size_t capacity = block_grow(0, resized);
+        in_place = (block_p) tree_malloc(block_bytes(capacity));
         memcpy(in_place, block, sizeof(block_t));
+        memset(block_data(in_place), 0, capacity * sizeof(tree_p));
         in_place->tree.refcount = 0;
+        in_place->capacity = capacity;
     }
     tree_p *src_data = block_data(block) + first;
     tree_p *dst_data = block_data(in_place);
@@ -105,21 +144,18 @@ void block_range(block_p *block_ptr, size_t first, size_t length)
         for (size_t i = end; i < block->length; i++)
             tree_dispose(&dst_data[i]);
 
-        // Remaining pointers can just be moved
+        // Remaining pointers can just be moved, and the rest cleared
         memmove(dst_data, src_data, resized * sizeof(tree_p));
+        memset(dst_data + resized, 0,
+               (block->length - resized) * sizeof(tree_p));
     }
     else
     {
-        // In_Place data and incrementits reference count
+        // Copy data and increment its reference count
         for (size_t i = 0; i < resized; i++)
-            tree_set(&dst_data[i], (tree_p) src_data[i]);
+            dst_data[i] = tree_use(src_data[i]);
     }
     in_place->length = resized;
-    if (in_place == block)
-    {
-        // We did the in_place in place: need to truncate result
-        in_place = (block_p) tree_realloc((tree_p) in_place, resized_bytes);
-    }
     block_unref(block);
     if (in_place != block)
         block_set(block_ptr, in_place);
@@ -147,7 +183,7 @@ tree_p block_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     case TREE_SIZE:
         // Return the size of the tree in bytes (is dynamic for blocks)
-        return (tree_p) (sizeof(block_t) + block->length * sizeof(tree_p));
+        return (tree_p) block_bytes(block->capacity);
 
     case TREE_ARITY:
         // Blocks have a variable number of children
@@ -171,9 +207,10 @@ tree_p block_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         size = va_arg(va, size_t);
         children_src = va_arg(va, tree_p *);
 
-        // Create block and copy data in it
-        block = (block_p) tree_malloc(sizeof(block_t) + size * sizeof(tree_p));
+        // Create block and copy data in it, leaving room for small blocks
+        block = (block_p) tree_malloc(block_bytes(block_grow(0, size)));
         block->length = size;
+        block->capacity = block_grow(0, size);
         block->opening = name_use(opening);
         block->closing = name_use(closing);
         block->separator = name_use(separator);
@@ -183,6 +220,8 @@ tree_p block_handler(tree_cmd_t cmd, tree_p tree, va_list va)
             child = *children_src++;
             *children_dst++ = tree_use(child);
         }
+        memset(children_dst, 0,
+               (block->capacity - block->length) * sizeof(tree_p));
         return (tree_p) block;
 
     case TREE_RENDER:
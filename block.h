@@ -29,12 +29,18 @@ typedef struct block
 // ----------------------------------------------------------------------------
 //    Internal representation of a block
 // ----------------------------------------------------------------------------
+//   Children are allocated after the block, with room for a few of them
+//   even for an empty block, so that small blocks never reallocate.
 {
     tree_t tree;
     size_t length;
+    size_t capacity;
     name_p opening, closing, separator;
 } block_t;
 
+// Number of children a block can hold without growing
+#define BLOCK_INLINE    4
+
 #ifdef BLOCK_C
 #define inline extern inline
 #endif
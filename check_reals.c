@@ -0,0 +1,299 @@
+// ****************************************************************************
+//  check_reals.c                                   XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Check that the scanner converts decimal reals exactly like strtod
+//
+//     A reproducible random corpus of decimal reals is scanned, and the
+//     value of each real is compared bit for bit with the result of strtod
+//     on the same spelling. The corpus mixes short reals taking the fast
+//     path, long mantissas, subnormals, and values halfway between two
+//     doubles, exactly or off by the smallest long double step.
+//
+//     Usage: check_reals [-count N] [-syntax FILE] [files...]
+//     For files given on the command line, each real is printed with its
+//     exact value, so that they can be used as test references.
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#include "error.h"
+#include "number.h"
+#include "position.h"
+#include "recorder.h"
+#include "scanner.h"
+#include "syntax.h"
+#include "text.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PREFIX_PATH
+#define PREFIX_PATH     ""
+#endif
+
+RECORDER(CHECK_REALS, 32, "Checking real numbers against strtod");
+
+
+
+// ============================================================================
+//
+//    Random corpus
+//
+// ============================================================================
+
+static uint64_t check_seed = 0x9E3779B97F4A7C15ull;
+
+
+static uint64_t check_random(uint64_t range)
+// ----------------------------------------------------------------------------
+//   Return a pseudo-random number in 0..range-1 (xorshift), 0 for all bits
+// ----------------------------------------------------------------------------
+{
+    check_seed ^= check_seed << 13;
+    check_seed ^= check_seed >> 7;
+    check_seed ^= check_seed << 17;
+    return range ? check_seed % range : check_seed;
+}
+
+
+static void check_digits(FILE *out, unsigned count)
+// ----------------------------------------------------------------------------
+//   Emit a mantissa with the given number of digits, and one before the dot
+// ----------------------------------------------------------------------------
+{
+    fputc('1' + check_random(9), out);
+    fputc('.', out);
+    for (unsigned d = 1; d < count || d == 1; d++)
+    {
+        fputc('0' + check_random(10), out);
+        if (d + 1 < count && !check_random(16))
+            fputc('_', out);
+    }
+}
+
+
+static void check_exact(FILE *out, long double value)
+// ----------------------------------------------------------------------------
+//   Emit the exact decimal expansion of a long double, without extra zeros
+// ----------------------------------------------------------------------------
+//   Binary fractions always have a finite decimal expansion. With a 64-bit
+//   mantissa, it has fewer than 800 significant digits even for subnormals.
+{
+    char buffer[900];
+    snprintf(buffer, sizeof(buffer), "%.800Le", value);
+    char *exponent = strchr(buffer, 'e');
+    char *end = exponent;
+    while (end[-1] == '0' && end[-2] != '.')
+        end--;
+    fprintf(out, "%.*s%s", (int) (end - buffer), buffer, exponent);
+}
+
+
+static double check_random_double(void)
+// ----------------------------------------------------------------------------
+//   Return a random positive finite double, including subnormals
+// ----------------------------------------------------------------------------
+{
+    double value;
+    do
+    {
+        uint64_t bits = check_random(0) & ~(1ull << 63);
+        memcpy(&value, &bits, sizeof(value));
+    } while (!isfinite(value) || value == 0.0);
+    return value;
+}
+
+
+static void check_generate(FILE *out, unsigned count)
+// ----------------------------------------------------------------------------
+//   Write count random decimal reals, one per line
+// ----------------------------------------------------------------------------
+{
+    for (unsigned n = 0; n < count; n++)
+    {
+        switch(check_random(6))
+        {
+        case 0:
+            // Short reals with a small exponent, the common case
+            check_digits(out, 1 + check_random(15));
+            fprintf(out, "e%d", (int) check_random(45) - 22);
+            break;
+        case 1:
+            // Long mantissas, truncated by the scanner
+            check_digits(out, 16 + check_random(30));
+            fprintf(out, "e%d", (int) check_random(80) - 40);
+            break;
+        case 2:
+            // Any exponent, including overflow and underflow
+            check_digits(out, 1 + check_random(25));
+            fprintf(out, "e%d", (int) check_random(680) - 345);
+            break;
+        case 3:
+            // Shortest representation of a random double
+            fprintf(out, "%.17e", check_random_double());
+            break;
+        default:
+#if LDBL_MANT_DIG >= 64
+        {
+            // Halfway between two doubles, and just below or above
+            double low = check_random_double();
+            double high = nextafter(low, INFINITY);
+            long double half = low + ((long double) high - low) / 2;
+            if (check_random(3) == 1)
+                half = nextafterl(half, 0);
+            else if (check_random(2))
+                half = nextafterl(half, INFINITY);
+            check_exact(out, half);
+            break;
+        }
+#else
+            fprintf(out, "%.17e", check_random_double());
+            break;
+#endif // LDBL_MANT_DIG
+        }
+        fputc('\n', out);
+    }
+}
+
+
+
+// ============================================================================
+//
+//    Checking the reals
+//
+// ============================================================================
+
+static double check_strtod(text_p spelling)
+// ----------------------------------------------------------------------------
+//   Return the value computed by strtod for a spelling, without the '_'
+// ----------------------------------------------------------------------------
+{
+    size_t length = text_length(spelling);
+    const char *data = text_data(spelling);
+    char *buffer = malloc(length + 1);
+    size_t size = 0;
+    for (size_t i = 0; i < length; i++)
+        if (data[i] != '_')
+            buffer[size++] = data[i];
+    buffer[size] = 0;
+    double result = strtod(buffer, NULL);
+    free(buffer);
+    return result;
+}
+
+
+static unsigned check_file(scanner_p s, const char *file, bool show,
+                           unsigned *checked)
+// ----------------------------------------------------------------------------
+//   Compare each real in the file with strtod, return number of mismatches
+// ----------------------------------------------------------------------------
+{
+    unsigned mismatches = 0;
+    FILE *f = scanner_open(s, file);
+    if (!f)
+    {
+        fprintf(stderr, "Cannot open '%s'\n", file);
+        return 1;
+    }
+    for (token_t t = scanner_read(s); t != tokEOF; t = scanner_read(s))
+    {
+        if (t != tokREAL)
+            continue;
+        text_p spelling = text_use(scanner_source(s));
+        double scanned = real_value(s->scanned.real);
+        double expected = check_strtod(spelling);
+        bool same = memcmp(&scanned, &expected, sizeof(double)) == 0;
+        (*checked)++;
+        if (show || (!same && mismatches < 10))
+        {
+            printf("%.*s = %.17g (%a)",
+                   (int) text_length(spelling), text_data(spelling),
+                   scanned, scanned);
+            if (same)
+                printf("\n");
+            else
+                printf(", strtod gives %.17g (%a)\n", expected, expected);
+        }
+        mismatches += !same;
+        text_dispose(&spelling);
+    }
+    scanner_close(s, f);
+    return mismatches;
+}
+
+
+
+// ============================================================================
+//
+//    Main entry point
+//
+// ============================================================================
+
+int main(int argc, char *argv[])
+// ----------------------------------------------------------------------------
+//   Check a random corpus, or the files given as arguments
+// ----------------------------------------------------------------------------
+{
+    const char *syntax_file = PREFIX_PATH "xl.syntax";
+    unsigned    count       = 1000000;
+    unsigned    checked     = 0;
+    unsigned    mismatches  = 0;
+    int         arg;
+
+    recorder_dump_on_common_signals(0,0);
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "-count") == 0 && arg + 1 < argc)
+            count = strtoul(argv[++arg], NULL, 10);
+        else if (strcmp(argv[arg], "-syntax") == 0 && arg + 1 < argc)
+            syntax_file = argv[++arg];
+        else
+            break;
+    }
+
+    syntax_p    syntax    = syntax_use(syntax_new(syntax_file));
+    positions_p positions = positions_new();
+    positions_p outer     = error_set_positions(positions);
+    scanner_p   s         = scanner_new(positions, syntax);
+
+    if (arg < argc)
+    {
+        for (; arg < argc; arg++)
+            mismatches += check_file(s, argv[arg], true, &checked);
+    }
+    else
+    {
+        char file[] = "/tmp/check_reals_XXXXXX";
+        int fd = mkstemp(file);
+        FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!out)
+        {
+            perror("Cannot create corpus file");
+            return 1;
+        }
+        check_generate(out, count);
+        fclose(out);
+        mismatches = check_file(s, file, false, &checked);
+        unlink(file);
+        printf("%u reals checked, %u differ from strtod\n",
+               checked, mismatches);
+    }
+
+    scanner_delete(s);
+    error_set_positions(outer);
+    positions_delete(positions);
+    syntax_dispose(&syntax);
+    RECORD(CHECK_REALS, "Checked %u reals, %u mismatches", checked, mismatches);
+    return mismatches != 0;
+}
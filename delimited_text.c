@@ -69,6 +69,7 @@ tree_p delimited_text_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         dt->value = text_use(value);
         dt->opening = name_use(opening);
         dt->closing = name_use(closing);
+        return (tree_p) dt;
 
     case TREE_DELETE:
     case TREE_COPY:
@@ -0,0 +1,330 @@
+// ****************************************************************************
+//  epoch.c                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Implementation of epoch-based reclamation for shared trees
+//
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+
+#define EPOCH_C
+#include "epoch.h"
+#include "blob.h"
+#include "recorder.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+
+RECORDER(EPOCH, 64, "Epoch-based reclamation of shared trees");
+
+
+typedef struct epoch_retired
+// ----------------------------------------------------------------------------
+//   A tree waiting for readers to leave before it can be disposed of
+// ----------------------------------------------------------------------------
+{
+    tree_p                  tree;       // Retired tree
+    uintptr_t               epoch;      // Global epoch when it was retired
+    struct epoch_retired *  next;       // Next retired tree for this thread
+} epoch_retired_t, *epoch_retired_p;
+
+
+typedef struct epoch_thread
+// ----------------------------------------------------------------------------
+//   Per-thread reclamation state
+// ----------------------------------------------------------------------------
+//   Records are never freed, but are reused once a thread exits.
+//   The state is the observed epoch shifted left by one, plus 1 if active
+{
+    uintptr_t               state;      // Observed epoch and activity
+    unsigned                nesting;    // Nested epoch_enter calls
+    bool                    in_use;     // Record belongs to a live thread
+    epoch_retired_p         retired;    // Trees retired by this thread
+    struct epoch_thread *   next;       // Global list of thread records
+} epoch_thread_t, *epoch_thread_p;
+
+
+#ifdef __GNUC__
+
+#define epoch_load(Value)       __atomic_load_n(&Value, __ATOMIC_SEQ_CST)
+#define epoch_store(Value, New) __atomic_store_n(&Value, New, __ATOMIC_SEQ_CST)
+#define epoch_local             __thread
+
+#else // ! __GNUC__
+
+#warning "Compiler not supported yet - Not thread safe"
+#define epoch_load(Value)               (Value)
+#define epoch_store(Value, New)         (Value = New)
+#define epoch_local
+
+#endif
+
+static uintptr_t                epoch_global  = 0;
+static epoch_thread_p           epoch_threads = NULL;
+static epoch_local epoch_thread_p epoch_self  = NULL;
+
+
+
+// ============================================================================
+//
+//    Thread registration
+//
+// ============================================================================
+
+static epoch_thread_p epoch_thread(void)
+// ----------------------------------------------------------------------------
+//   Return the record for the current thread, registering it if needed
+// ----------------------------------------------------------------------------
+{
+    epoch_thread_p self = epoch_self;
+    if (self)
+        return self;
+
+    // Try to reuse the record of a thread that exited
+    for (self = epoch_load(epoch_threads); self; self = self->next)
+    {
+        bool in_use = false;
+        if (!epoch_load(self->in_use) &&
+            tree_compare_exchange(self->in_use, in_use, true))
+        {
+            epoch_self = self;
+            return self;
+        }
+    }
+
+    // Otherwise, create a new record and push it on the global list
+    self = calloc(1, sizeof(epoch_thread_t));
+    self->in_use = true;
+    epoch_thread_p head = epoch_load(epoch_threads);
+    do
+        self->next = head;
+    while (!tree_compare_exchange(epoch_threads, head, self));
+    record(EPOCH, "Registered thread record %p", self);
+    epoch_self = self;
+    return self;
+}
+
+
+void epoch_thread_exit(void)
+// ----------------------------------------------------------------------------
+//   Release the current thread's record, once its retired trees are freed
+// ----------------------------------------------------------------------------
+//   This must be called outside of any critical section
+{
+    epoch_thread_p self = epoch_self;
+    if (!self)
+        return;
+    assert(self->nesting == 0 && "Thread exiting within an epoch");
+    epoch_synchronize();
+    epoch_self = NULL;
+    epoch_store(self->in_use, false);
+}
+
+
+
+// ============================================================================
+//
+//    Readers critical sections
+//
+// ============================================================================
+
+void epoch_enter(void)
+// ----------------------------------------------------------------------------
+//   Enter a critical section where shared trees can be read
+// ----------------------------------------------------------------------------
+//   If the global epoch advances between the load and the store, the thread
+//   appears to be in the older epoch, which only delays reclamation.
+{
+    epoch_thread_p self = epoch_thread();
+    if (self->nesting++ == 0)
+        epoch_store(self->state, (epoch_load(epoch_global) << 1) | 1);
+}
+
+
+void epoch_exit(void)
+// ----------------------------------------------------------------------------
+//   Leave a critical section, after which shared pointers are invalid
+// ----------------------------------------------------------------------------
+{
+    epoch_thread_p self = epoch_self;
+    assert(self && self->nesting && "Unbalanced epoch_exit");
+    if (--self->nesting == 0)
+        epoch_store(self->state, 0);
+}
+
+
+
+// ============================================================================
+//
+//    Sharing and reclaiming trees
+//
+// ============================================================================
+
+// Number of published trees sharing a node, kept below the TREE_SHARED bit
+#define EPOCH_SHARE_ONE         (TREE_SHARED >> 16)
+#define EPOCH_SHARE_MASK        (TREE_SHARED - EPOCH_SHARE_ONE)
+
+
+void epoch_share(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Mark a tree and its children as shared, so that they are not counted
+// ----------------------------------------------------------------------------
+//   A subtree that is already shared, e.g. because it is also reachable
+//   from another published tree, only records one more sharer.
+{
+    if (!tree)
+        return;
+
+    refcnt_t count = epoch_load(tree->refcount);
+    refcnt_t shared;
+    if (count < TREE_SHARED)
+    {
+        // Readers must not race to copy the data of a lazy blob
+        blob_p blob = tree_cast(blob, tree);
+        if (blob)
+            blob_data(blob);
+    }
+    do
+    {
+        // Immortal trees are never released, saturated counts neither
+        if (count == TREE_IMMORTAL ||
+            (count >= TREE_SHARED &&
+             (count & EPOCH_SHARE_MASK) == EPOCH_SHARE_MASK))
+            return;
+        assert((count >= TREE_SHARED || count < EPOCH_SHARE_ONE) &&
+               "Too many references to share");
+        if (count >= TREE_SHARED)
+            shared = count + EPOCH_SHARE_ONE;
+        else
+            shared = count | TREE_SHARED | EPOCH_SHARE_ONE;
+    } while (!tree_compare_exchange(tree->refcount, count, shared));
+
+    if (count < TREE_SHARED)
+        tree_children_loop(tree, epoch_share(*child));
+}
+
+
+static void epoch_unshare(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Restore reference counting on a tree that no reader can see anymore
+// ----------------------------------------------------------------------------
+//   Nodes that other published trees still share, and their children,
+//   remain shared, so that they are not released with this tree.
+{
+    if (!tree)
+        return;
+
+    refcnt_t count = epoch_load(tree->refcount);
+    refcnt_t unshared;
+    do
+    {
+        if (count < TREE_SHARED || count == TREE_IMMORTAL ||
+            (count & EPOCH_SHARE_MASK) == EPOCH_SHARE_MASK)
+            return;
+        unshared = count - EPOCH_SHARE_ONE;
+        if ((unshared & EPOCH_SHARE_MASK) == 0)
+            unshared &= ~TREE_SHARED;
+    } while (!tree_compare_exchange(tree->refcount, count, unshared));
+
+    if (unshared < TREE_SHARED)
+        tree_children_loop(tree, epoch_unshare(*child));
+}
+
+
+void epoch_retire(tree_p *tree)
+// ----------------------------------------------------------------------------
+//   Take ownership of a shared tree, and dispose of it when safe
+// ----------------------------------------------------------------------------
+//   The caller must have unpublished the tree, so that no new reader
+//   can find it. Readers that already have it are waited for.
+{
+    tree_p retired = *tree;
+    if (!retired)
+        return;
+    *tree = NULL;
+
+    epoch_thread_p self = epoch_thread();
+    epoch_retired_p entry = malloc(sizeof(epoch_retired_t));
+    entry->tree = retired;
+    entry->epoch = epoch_load(epoch_global);
+    entry->next = self->retired;
+    self->retired = entry;
+    record(EPOCH, "Retired %p in epoch %lu", retired, entry->epoch);
+
+    epoch_collect();
+}
+
+
+unsigned epoch_collect(void)
+// ----------------------------------------------------------------------------
+//   Try to advance the global epoch, and dispose of old retired trees
+// ----------------------------------------------------------------------------
+//   A tree retired in epoch E was unpublished before the global epoch
+//   reached E+1. Once the epoch reaches E+2, all threads have been seen
+//   in E+1 or outside of any critical section, so no reader can hold it.
+//   Returns the number of trees that were disposed of.
+{
+    epoch_thread_p self = epoch_thread();
+    uintptr_t global = epoch_load(epoch_global);
+
+    bool advance = true;
+    for (epoch_thread_p t = epoch_load(epoch_threads); t; t = t->next)
+    {
+        uintptr_t state = epoch_load(t->state);
+        if ((state & 1) && (state >> 1) != global)
+        {
+            advance = false;
+            break;
+        }
+    }
+    if (advance && tree_compare_exchange(epoch_global, global, global + 1))
+        record(EPOCH, "Advanced to epoch %lu", global + 1);
+    global = epoch_load(epoch_global);
+
+    unsigned disposed = 0;
+    epoch_retired_p *last = &self->retired;
+    while (*last)
+    {
+        epoch_retired_p entry = *last;
+        if (entry->epoch + 2 <= global)
+        {
+            *last = entry->next;
+            epoch_unshare(entry->tree);
+            tree_dispose(&entry->tree);
+            free(entry);
+            disposed++;
+        }
+        else
+        {
+            last = &entry->next;
+        }
+    }
+    return disposed;
+}
+
+
+void epoch_synchronize(void)
+// ----------------------------------------------------------------------------
+//   Wait until all trees retired by the current thread are disposed of
+// ----------------------------------------------------------------------------
+//   This must be called outside of any critical section, or it never ends
+{
+    epoch_thread_p self = epoch_thread();
+    assert(self->nesting == 0 && "Cannot synchronize within an epoch");
+    while (self->retired)
+        if (!epoch_collect() && self->retired)
+            sched_yield();
+}
@@ -0,0 +1,61 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+// ****************************************************************************
+//  epoch.h                                         XL - An extensible language
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Epoch-based reclamation for trees shared between threads
+//
+//     Shared trees are read without touching their reference counts.
+//     A writer replacing a shared tree retires the old one, which is
+//     only released once no reader can still be looking at it.
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2017 Christophe de Dinechin <christophe@dinechin.org>
+//   This software is licensed under the GNU General Public License v3
+//   See LICENSE file for details.
+// ****************************************************************************
+/*
+  Reference counting a tree that many threads read concurrently makes
+  every tree_ref and tree_unref an atomic write to the same cache line,
+  even though no reader ever changes the tree. Epoch-based reclamation
+  removes this traffic for trees designated as shared:
+
+  - epoch_share marks a tree and all its children as shared. From that
+    point, tree_ref and tree_unref leave their count unchanged. This
+    must be done before the tree is published to other threads, while
+    no other thread holds references to its nodes.
+
+  - Readers bracket each access with epoch_enter / epoch_exit. Within
+    that critical section, they can follow pointers into shared trees
+    without taking references. They must not keep any pointer into a
+    shared tree after epoch_exit, unless they tree_clone it first.
+
+  - A writer that unpublishes a shared tree calls epoch_retire on it,
+    which transfers the writer's reference to the reclamation logic.
+    The tree is actually disposed of only after every thread that was
+    in a critical section at the time has left it.
+
+  The reference counts of shared trees are preserved underneath the
+  TREE_SHARED bit, along with the number of shared trees containing them.
+  A subtree also reachable from another shared tree stays shared when a
+  retired tree containing it is disposed of, and survives it.
+*/
+
+#include "tree.h"
+
+
+extern void     epoch_share(tree_p tree);
+extern void     epoch_retire(tree_p *tree);
+extern void     epoch_enter(void);
+extern void     epoch_exit(void);
+extern unsigned epoch_collect(void);
+extern void     epoch_synchronize(void);
+extern void     epoch_thread_exit(void);
+
+#endif // EPOCH_H
@@ -42,6 +42,10 @@ static errors_p    errors    = NULL;
 static positions_p positions = NULL;
 static renderer_p  renderer  = NULL;
 
+// Errors can be counted without being reported, independently in each thread
+static tree_thread_local bool     muted = false;
+static tree_thread_local unsigned muted_count = 0;
+
 RECORDER(ERROR, 64, "Error messages being recorder");
 
 
@@ -127,12 +131,20 @@ void errorv(srcpos_t position, const char *message, va_list va)
 //    Process the error message
 // ----------------------------------------------------------------------------
 {
-    text_p err = text_vprintf(position, message, va);
+    if (muted)
+    {
+        RECORD(ERROR, "Muted error message '%s'", message);
+        muted_count++;
+        return;
+    }
+
+    text_p err = text_use(text_vprintf(position, message, va));
     RECORD(ERROR, "Error message '%s' = '%s'", message, text_data(err));
     if (errors)
         errors_push(&errors, err);
     else
         error_display(err);
+    text_dispose(&err);
 }
 
 
@@ -238,6 +250,22 @@ void errors_clear(errors_p saved_errors)
 }
 
 
+unsigned errors_mute(bool mute)
+// ----------------------------------------------------------------------------
+//   Mute or unmute errors in this thread, return errors muted since last call
+// ----------------------------------------------------------------------------
+//   Muted errors are only counted, and not even formatted, since rendering
+//   trees for messages uses the shared error renderer. This is used by
+//   speculative scanning in other threads, which only needs to know if
+//   errors happened, in order to redo the work in the main thread.
+{
+    unsigned result = muted_count;
+    muted = mute;
+    muted_count = 0;
+    return result;
+}
+
+
 unsigned errors_count()
 // ----------------------------------------------------------------------------
 //   Return the number of errors in the current error list
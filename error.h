@@ -22,6 +22,7 @@
 // ****************************************************************************
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -44,5 +45,6 @@ extern errors_p     errors_save(void);
 extern void         errors_commit(errors_p errors);
 extern void         errors_clear(errors_p errors);
 extern unsigned     errors_count(void);
+extern unsigned     errors_mute(bool mute);
 
 #endif // ERROR_H
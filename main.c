@@ -28,12 +28,85 @@
 #include "renderer.h"
 #include "text.h"
 
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
 RECORDER(MAIN, 32, "Main function");
 
+// Printing a tree recurses on its depth, so deeper blocks are rejected
+#define MAIN_DEFAULT_DEPTH      10000
+
+
+static const char *token_names[] =
+// ----------------------------------------------------------------------------
+//   Names of the tokens, in the order of token_t
+// ----------------------------------------------------------------------------
+{
+    "NONE", "EOF", "INTEGER", "REAL", "TEXT", "CHARACTER", "LONGTEXT",
+    "NAME", "SYMBOL", "BLOB", "NEWLINE", "OPEN", "CLOSE", "INDENT",
+    "UNINDENT", "ERROR"
+};
+
+
+static void print_tokens(FILE *out, const char *file,
+                         positions_p positions, syntax_p syntax,
+                         scanner_cache_p cache, unsigned threads)
+// ----------------------------------------------------------------------------
+//   Print the tokens in a file, one per line, without parsing it
+// ----------------------------------------------------------------------------
+{
+    scanner_p s = scanner_new(positions, syntax);
+    FILE *f = scanner_open(s, file);
+    scanner_cache(s, cache);
+    scanner_tokens_p tokens = scanner_tokenize(s, threads);
+
+    for (size_t t = 0; t < tokens->count; t++)
+    {
+        scanner_token_p token = &tokens->tokens[t];
+        position_t      info;
+        position_info(positions, tokens->position + token->offset, &info);
+        fprintf(out, "%u:%u\t%s", info.line, info.column,
+                token_names[token->kind]);
+        switch(token->kind)
+        {
+        case tokNEWLINE:
+        case tokINDENT:
+        case tokUNINDENT:
+        case tokEOF:
+            break;
+        default:
+            if (tokens->source)
+            {
+                // Blobs may end with blanks, long texts span lines
+                const char *spelling = tokens->source + token->offset;
+                size_t      length   = token->length;
+                while (length && isspace((uint8_t) spelling[length-1]))
+                    length--;
+                fputc('\t', out);
+                for (size_t i = 0; i < length; i++)
+                {
+                    if (spelling[i] == '\n')
+                        fputs("\\n", out);
+                    else if (spelling[i] == '\t')
+                        fputs("\\t", out);
+                    else
+                        fputc(spelling[i], out);
+                }
+            }
+            break;
+        }
+        fputc('\n', out);
+    }
+
+    scanner_tokens_delete(tokens);
+    scanner_close(s, f);
+    scanner_delete(s);
+}
+
+
 int main(int argc, char *argv[])
 // ----------------------------------------------------------------------------
 //   Main entry point for the XL interpreter / compiler
@@ -52,17 +125,78 @@ int main(int argc, char *argv[])
     renderer_p renderer = renderer_new(PREFIX_PATH "xl.stylesheet");
     error_set_renderer(renderer);
 
-    syntax_p syntax = syntax_use(syntax_new(PREFIX_PATH "xl.syntax"));
+    syntax_p        syntax = syntax_use(syntax_new(PREFIX_PATH "xl.syntax"));
+    bool            tokens_only = false;
+    bool            compact     = false;
+    unsigned        threads     = 0;
+    size_t          depth       = MAIN_DEFAULT_DEPTH;
+    size_t          budget      = 0;
+    scanner_cache_t cache       = { NULL, 0, 0 };
     for (int arg = 1; arg < argc; arg++)
     {
+        // Options: -tokens prints tokens, -lex N lexes ahead with N threads,
+        // -cache DIR keeps the tokens of unchanged files in DIR,
+        // -depth N limits the nesting of blocks to N levels (0 for none),
+        // -budget B limits the memory allocated while parsing to B bytes,
+        // -compact copies parsed trees into a single allocation
+        if (strcmp(argv[arg], "-tokens") == 0)
+        {
+            tokens_only = true;
+            continue;
+        }
+        if (strcmp(argv[arg], "-compact") == 0)
+        {
+            compact = true;
+            continue;
+        }
+        if (strcmp(argv[arg], "-lex") == 0 && arg + 1 < argc)
+        {
+            threads = atoi(argv[++arg]);
+            continue;
+        }
+        if (strcmp(argv[arg], "-cache") == 0 && arg + 1 < argc)
+        {
+            cache.directory = argv[++arg];
+            continue;
+        }
+        if (strcmp(argv[arg], "-depth") == 0 && arg + 1 < argc)
+        {
+            depth = strtoul(argv[++arg], NULL, 10);
+            continue;
+        }
+        if (strcmp(argv[arg], "-budget") == 0 && arg + 1 < argc)
+        {
+            budget = strtoul(argv[++arg], NULL, 10);
+            continue;
+        }
+        scanner_cache_p cached = cache.directory ? &cache : NULL;
+        if (tokens_only)
+        {
+            print_tokens(stdout, argv[arg], positions, syntax, cached,
+                         threads ? threads : 1);
+            continue;
+        }
+
         parser_p parser = parser_new(argv[arg], positions, syntax);
+        scanner_cache(parser->scanner, cached);
+        parser_lex(parser, threads || !cached ? threads : 1);
+        parser_depth(parser, depth);
+        parser_budget(parser, budget);
         tree_p tree = tree_use(parser_parse(parser));
+        if (compact)
+            tree_compact(&tree);
         fprintf(stderr, "File #%d: %s: ", arg, argv[arg]);
-        tree_print(stderr, tree);
+        if (tree)
+            tree_print(stderr, tree);
         parser_delete(parser);
         tree_dispose(&tree);
     }
 
+    if (cache.directory)
+        fprintf(stderr, "%sToken cache %s: %u hits, %u misses\n",
+                tokens_only ? "" : "\n",
+                cache.directory, cache.hits, cache.misses);
+
     syntax_dispose(&syntax);
     renderer_delete(renderer);
     positions_delete(positions);
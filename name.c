@@ -22,16 +22,16 @@
 #define NAME_C
 #include "name.h"
 #include "renderer.h"
+#include "scanner.h"
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
 bool name_is_operator(name_p name)
 // ----------------------------------------------------------------------------
 //   Return true if the name is an operator (e.g. + or -=)
 // ----------------------------------------------------------------------------
 {
-    return ispunct(*name_data(name));
+    return scanner_char_is(*name_data(name), SCANNER_SYMBOL|SCANNER_QUOTE);
 }
 
 
@@ -42,16 +42,16 @@ bool name_is_valid(size_t size, const char *data)
 {
     if (size)
     {
-        if (ispunct(*data))
+        if (scanner_char_is(*data, SCANNER_SYMBOL|SCANNER_QUOTE))
         {
             while (size--)
             {
-                if (!ispunct(*data++))
+                if (!scanner_char_is(*data++, SCANNER_SYMBOL|SCANNER_QUOTE))
                     return false;
             }
             return true;
         }
-        else if (isalpha(*data))
+        else if (scanner_char_is(*data, SCANNER_NAME_FIRST))
         {
             bool had_underscore = true;
             while (size--)
@@ -60,7 +60,7 @@ bool name_is_valid(size_t size, const char *data)
                 if (c == '_' && had_underscore)
                     return false;
                 had_underscore = c == '_';
-                if (!had_underscore && !isalnum(c))
+                if (!had_underscore && !scanner_char_is(c, SCANNER_NAME_NEXT))
                     return false;
             }
             return true;
@@ -82,6 +82,112 @@ bool name_is_valid(size_t size, const char *data)
 }
 
 
+
+
+// ============================================================================
+//
+//   Name interning
+//
+// ============================================================================
+
+typedef struct name_interned
+// ----------------------------------------------------------------------------
+//   An entry in the table of interned names
+// ----------------------------------------------------------------------------
+//   Entries are never removed, so lookups can walk chains without locking
+{
+    name_p                  name;       // Canonical name, immortal
+    size_t                  hash;       // Hash value for the name
+    struct name_interned *  next;       // Next entry in the same bucket
+} name_interned_t, *name_interned_p;
+
+
+#ifdef __GNUC__
+#define name_load(Value)        __atomic_load_n(&Value, __ATOMIC_ACQUIRE)
+#else // ! __GNUC__
+#define name_load(Value)        (Value)
+#endif
+
+// Number of buckets in the table, which is not resized
+#define NAME_INTERN_BUCKETS     16384
+
+static name_interned_p name_interned[NAME_INTERN_BUCKETS];
+
+
+static inline size_t name_hash(size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash for the spelling of a name
+// ----------------------------------------------------------------------------
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (size--)
+        hash = (hash ^ (uint8_t) *data++) * 0x100000001b3ULL;
+    return (size_t) hash;
+}
+
+
+static name_p name_lookup(name_interned_p entry, name_interned_p last,
+                          size_t hash, size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Look for an interned name in a bucket chain, stopping at last
+// ----------------------------------------------------------------------------
+{
+    for (; entry != last; entry = entry->next)
+        if (entry->hash == hash &&
+            name_length(entry->name) == size &&
+            memcmp(name_data(entry->name), data, size) == 0)
+            return entry->name;
+    return NULL;
+}
+
+
+name_p name_intern(size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Return the canonical name with the given spelling, creating it if needed
+// ----------------------------------------------------------------------------
+//   Interned names are immortal and have no source position, so that the
+//   same node can be returned for every occurrence, and compared by address.
+//   The table can be used concurrently: new entries are inserted at the
+//   head of their bucket with a compare-and-exchange, and if another thread
+//   won the race, we look again in the entries it added.
+//   The table is never trimmed and lives as long as the process: it grows
+//   by every distinct spelling ever scanned. A new name is charged to the
+//   memory budget of the parse that first sees it, so a budget bounds what
+//   one input can add, but a long-running process that parses untrusted
+//   input keeps all the names from all its inputs.
+{
+    size_t           hash   = name_hash(size, data);
+    name_interned_p *bucket = &name_interned[hash % NAME_INTERN_BUCKETS];
+    name_interned_p  head   = name_load(*bucket);
+    name_p           result = name_lookup(head, NULL, hash, size, data);
+    if (result)
+        return result;
+
+    name_p           name   = name_new(0, size, data);
+    name_interned_p  entry  = malloc(sizeof(name_interned_t));
+    entry->name = (name_p) tree_immortal((tree_p) name);
+    entry->hash = hash;
+    entry->next = head;
+    while (!tree_compare_exchange(*bucket, entry->next, entry))
+    {
+        // Only look at entries inserted since we last looked
+        name_interned_p seen = head;
+        head = name_load(*bucket);
+        result = name_lookup(head, seen, hash, size, data);
+        if (result)
+        {
+            // Another thread interned the same name, use it instead
+            name->text.blob.tree.refcount = 0;
+            name_delete(name);
+            free(entry);
+            return result;
+        }
+        entry->next = head;
+    }
+    return name;
+}
+
+
 tree_p name_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 // ----------------------------------------------------------------------------
 //   The handler for names deals mostly with variable-sized initialization
@@ -39,6 +39,7 @@ typedef struct name
 blob_type(char, name);
 extern bool name_is_operator(name_p name);
 extern bool name_is_valid(size_t size, const char *data);
+extern name_p name_intern(size_t size, const char *data);
 inline bool name_eq(name_p, const char *value);
 
 // Private name handler, should not be called directly in general
@@ -46,6 +47,7 @@ extern tree_p   name_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 // Helper macro to initialize with a C constant
 #define name_cnew(pos, name)    name_new(pos, strlen(name), name)
+#define name_static(var, str)   blob_static(name, var, str)
 
 #undef inline
 
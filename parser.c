@@ -26,6 +26,10 @@
 #include "delimited_text.h"
 
 
+// Constant names created while parsing, shared to avoid allocations
+name_static(parser_newline, "\n");
+name_static(parser_indent,  SYNTAX_INDENT);
+
 
 // ============================================================================
 //
@@ -47,22 +51,85 @@ parser_p parser_new(const char *filename,
     p->scanner = s;
     p->comment = NULL;
     p->pending = tokNONE;
+    p->budget.limit = 0;
+    p->budget.used = 0;
+    p->budget.allocations = 0;
+    p->budget.exceeded = false;
+    p->tokens = NULL;
+    p->lex_threads = 0;
+    p->stack = NULL;
+    p->stack_depth = 0;
+    p->stack_capacity = 0;
+    p->items = NULL;
+    p->items_depth = 0;
+    p->items_capacity = 0;
+    p->frames = NULL;
+    p->frames_depth = 0;
+    p->frames_capacity = 0;
+    p->depth_limit = 0;
     p->had_space_before = false;
     p->had_space_after = false;
     p->beginning_line = false;
+    p->over_budget = false;
+    p->too_deep = false;
 
     return p;
 }
 
 
+size_t parser_budget(parser_p p, size_t limit)
+// ----------------------------------------------------------------------------
+//   Set the memory budget for parsing (0 for unlimited), return old one
+// ----------------------------------------------------------------------------
+{
+    size_t old = p->budget.limit;
+    p->budget.limit = limit;
+    return old;
+}
+
+
+size_t parser_depth(parser_p p, size_t limit)
+// ----------------------------------------------------------------------------
+//   Set the maximum nesting depth of blocks (0 for unlimited), return old one
+// ----------------------------------------------------------------------------
+//   Blocks are parsed without recursion, so by default nesting is only
+//   limited by memory. Exceeding the limit is an error that stops parsing,
+//   returning the tree parsed until then.
+{
+    size_t old = p->depth_limit;
+    p->depth_limit = limit;
+    return old;
+}
+
+
+unsigned parser_lex(parser_p p, unsigned threads)
+// ----------------------------------------------------------------------------
+//   Lex input ahead of parsing with the given threads (0 to scan as we go)
+// ----------------------------------------------------------------------------
+//   The parser then replays tokens recorded by scanner_lex. Scanner errors
+//   are reported when the tokens are lexed, before parse errors for them.
+{
+    unsigned old = p->lex_threads;
+    p->lex_threads = threads;
+    return old;
+}
+
+
 void parser_delete(parser_p p)
 // ----------------------------------------------------------------------------
 //    Delete a parser
 // ----------------------------------------------------------------------------
 {
+    if (p->tokens)
+        scanner_tokens_delete(p->tokens);
     scanner_close(p->scanner, (FILE *) p->scanner->stream);
     scanner_delete(p->scanner);
     text_dispose(&p->comment);
+    assert(!p->stack_depth && !p->items_depth && !p->frames_depth &&
+           "Parser stacks not empty");
+    free(p->stack);
+    free(p->items);
+    free(p->frames);
     free(p);
 }
 
@@ -80,16 +147,107 @@ typedef struct pending
 // ----------------------------------------------------------------------------
 // For example, when parsing A+B*C, it will hold (A, +) and (B, *)
 // We push 3 trees for each level: the opcode, the argument and the priority
+// The stack belongs to the parser and is reused by all blocks, each block
+// using the entries above the depth it had when the block began.
 {
     name_p      opcode;         // The opcode, e.g. + or *
     tree_p      argument;       // The argument, e.g. A or B
     unsigned    priority;       // The priority, to know when to pop
+    srcpos_t    position;       // Position of the opcode
 } pending_t, *pending_p;
 
-#define inline extern inline
-blob_type(pending_t, pending_stack);
-blob_type_handler(pending_stack);
-#undef inline
+
+static void parser_push(parser_p p, name_p opcode, tree_p argument,
+                        unsigned priority, srcpos_t position)
+// ----------------------------------------------------------------------------
+//   Push a pending operation, growing the stack only when it is full
+// ----------------------------------------------------------------------------
+{
+    if (p->stack_depth == p->stack_capacity)
+    {
+        p->stack_capacity = p->stack_capacity ? 2 * p->stack_capacity : 64;
+        p->stack = realloc(p->stack, p->stack_capacity * sizeof(pending_t));
+    }
+    pending_p pending = &p->stack[p->stack_depth++];
+    pending->opcode = opcode;
+    pending->argument = argument;
+    pending->priority = priority;
+    pending->position = position;
+    if (opcode)
+        name_ref(opcode);
+    tree_ref(argument);
+}
+
+
+static void parser_push_item(parser_p p, tree_p item)
+// ----------------------------------------------------------------------------
+//   Push an item of the block being parsed, until the block is created
+// ----------------------------------------------------------------------------
+{
+    if (p->items_depth == p->items_capacity)
+    {
+        p->items_capacity = p->items_capacity ? 2 * p->items_capacity : 64;
+        p->items = realloc(p->items, p->items_capacity * sizeof(tree_p));
+    }
+    p->items[p->items_depth++] = tree_use(item);
+}
+
+
+static token_t parser_read(parser_p p)
+// ----------------------------------------------------------------------------
+//    Read the next token, from the scanner or from tokens lexed ahead
+// ----------------------------------------------------------------------------
+{
+    scanner_p scanner = p->scanner;
+    while (p->tokens || p->lex_threads)
+    {
+        if (p->tokens)
+        {
+            token_t tok = scanner_replay(scanner, p->tokens);
+            if (tok != tokNONE)
+                return tok;
+            scanner_tokens_delete(p->tokens);
+            p->tokens = NULL;
+        }
+        if (p->lex_threads)
+        {
+            // Leave line starts raw, the parser changes indentation rules
+            bool raw = scanner->raw_indent;
+            scanner->raw_indent = true;
+            p->tokens = scanner_lex(scanner, p->lex_threads);
+            scanner->raw_indent = raw;
+        }
+    }
+    return scanner_read(scanner);
+}
+
+
+static srcpos_t parser_scanned_position(parser_p p)
+// ----------------------------------------------------------------------------
+//    Return the scanner position after the last token read
+// ----------------------------------------------------------------------------
+{
+    scanner_tokens_p tokens = p->tokens;
+    if (tokens && tokens->next)
+        return tokens->position + tokens->tokens[tokens->next - 1].end;
+    return position(p->scanner->positions);
+}
+
+
+static text_p parser_source(parser_p p)
+// ----------------------------------------------------------------------------
+//    Return the spelling of the last token read
+// ----------------------------------------------------------------------------
+{
+    scanner_tokens_p tokens = p->tokens;
+    if (tokens && tokens->next && tokens->source)
+    {
+        scanner_token_p token = &tokens->tokens[tokens->next - 1];
+        return text_new(tokens->position + token->offset, token->length,
+                        tokens->source + token->offset);
+    }
+    return scanner_source(p->scanner);
+}
 
 
 static token_t parser_token(parser_p p)
@@ -105,6 +263,10 @@ static token_t parser_token(parser_p p)
     name_p      closing   = NULL;
     token_t     result    = tokNONE;
 
+    // Stop parsing once blocks were nested too deep
+    if (p->too_deep)
+        return tokERROR;
+
     while (result == tokNONE)
     {
         token_t pend = p->pending;
@@ -117,19 +279,34 @@ static token_t parser_token(parser_p p)
         }
 
         // Here, there's nothing pending or only a newline
-        token_t next = scanner_read(scanner);
+        token_t next = parser_read(p);
         p->had_space_before = scanner->had_space_before;
         p->had_space_after = scanner->had_space_after;
         result = next;
 
+        // Stop parsing if we allocated more than the memory budget
+        if (tree_budget_exceeded())
+        {
+            if (!p->over_budget)
+                error(parser_scanned_position(p),
+                      "Memory budget of %zu bytes exceeded while parsing",
+                      tree_budget()->limit);
+            p->over_budget = true;
+            p->pending = tokNONE;
+            result = tokERROR;
+            continue;
+        }
+
         switch(next)
         {
         case tokNAME:
         case tokSYMBOL:
-            name_set(&opening, scanner->scanned.name);
+            // Scanned names are interned, no need to take a reference
+            opening = scanner->scanned.name;
             if (name_eq(opening, "syntax"))
             {
                 syntax_read(scanner->syntax, scanner);
+                result = tokNONE;
                 continue;
             }
             else if (syntax_is_comment(syntax, opening, &closing))
@@ -146,14 +323,15 @@ static token_t parser_token(parser_p p)
                     p->pending = tokNEWLINE;
                     p->beginning_line = true;
                 }
+                result = tokNONE;
                 continue;
             }
             else if (syntax_is_text(syntax, opening, &closing))
             {
+                srcpos_t pos = scanner->token_position;
                 text_p val = scanner_skip(scanner, closing);
                 name_p op = (name_p) opening;
                 name_p cl = (name_p) closing;
-                srcpos_t pos = name_position(op);
                 delimited_text_p dt = delimited_text_new(pos, val, op, cl);
                 tree_set(&scanner->scanned.tree, (tree_p) dt);
                 if (pend == tokNEWLINE)
@@ -231,13 +409,25 @@ static token_t parser_token(parser_p p)
         }
     } // While loop
 
-    name_dispose(&opening);
     name_dispose(&closing);
     return result;
 }
 
 
-static inline tree_p parser_prefix_new(name_p left, tree_p right)
+static inline srcpos_t parser_position(tree_p tree,
+                                       name_p name, srcpos_t name_pos)
+// ----------------------------------------------------------------------------
+//   Return the position of a tree, using the scanned position for names
+// ----------------------------------------------------------------------------
+{
+    if (tree && tree == (tree_p) name)
+        return name_pos;
+    return tree_position(tree);
+}
+
+
+static inline tree_p parser_prefix_new(srcpos_t pos,
+                                       name_p left, tree_p right)
 // ----------------------------------------------------------------------------
 //   Create a prefix, special-case unary minus with constants
 // ----------------------------------------------------------------------------
@@ -262,276 +452,457 @@ static inline tree_p parser_prefix_new(name_p left, tree_p right)
             return (tree_p) r;
         }
     }
-    return (tree_p) prefix_new(name_position(left), left, right);
+    return (tree_p) prefix_new(pos, left, right);
 }
 
 
-static inline tree_p parser_pfix_new(tree_p left, tree_p right)
+static inline tree_p parser_pfix_new(srcpos_t pos, tree_p left, tree_p right)
 // ----------------------------------------------------------------------------
 //    If left is a name, create a prefix, else a pfix
 // ----------------------------------------------------------------------------
+//    The position is given, since interned names do not record one
 {
     name_p name = name_cast(left);
     if (name)
-        return parser_prefix_new(name, right);
-    return (tree_p) pfix_new(tree_position(left), left, right);
+        return parser_prefix_new(pos, name, right);
+    return (tree_p) pfix_new(pos, left, right);
 }
 
 
-static tree_p parser_block(parser_p p,
-                           name_p   block_opening,
-                           name_p   block_closing,
-                           int      block_priority)
+typedef struct parser_frame
 // ----------------------------------------------------------------------------
-//    Parse input until we reach block_end
+//   The state of a block being parsed
 // ----------------------------------------------------------------------------
-// XL parsing is not very difficult, but a bit unusual, because it is based
-// solely on dynamic information and not, for instance, on keywords.
-// Consider the following cases, where p is "prefix-op" and i is "infix-op"
-//     Write A
-//       Parses as p(Write,A).
-//     A and B
-//       Parses as i(and,A,B) if 'and' has a priority,
-//              as p(A,p(and,B)) otherwise
-//     Write -A,B
-//       This parses as (Write-A),B since "-" has a priority.
-//       This one is fixed "artificially" by using spaces around -
-//       If there is a space before but not after, we parse as
-//           Write (-A), B
+//   Nested blocks are parsed with frames on a stack owned by the parser
+//   rather than by recursion, so that nesting is not limited by the C stack
 {
-    typedef pending_stack_p stack_p;
-
-    scanner_p   scanner            = p->scanner;
-    positions_p positions          = scanner->positions;
-    srcpos_t    pos                = position(positions);
-
-    tree_p      result             = NULL;
-    tree_p      left               = NULL;
-    tree_p      right              = NULL;
-    name_p      infix              = NULL;
-    name_p      name               = NULL;
-    name_p      opening            = NULL;
-    name_p      closing            = NULL;
-    block_p     block              = NULL;
-    stack_p     stack              = pending_stack_new(pos, 0, NULL);
-    syntax_p    syntax             = syntax_use(scanner->syntax);
-    syntax_p    child_syntax       = NULL;
-    name_p      child_syntax_end   = NULL;
-
-    int         default_priority   = syntax->default_priority;
-    int         function_priority  = syntax->function_priority;
-    int         statement_priority = syntax->statement_priority;
-    int         result_priority    = default_priority;
-    int         prefix_priority    = 0;
-    int         prefix_vs_infix    = 0;
-    int         postfix_priority   = 0;
-    int         infix_priority     = 0;
-    unsigned    old_indent         = 0;
-    token_t     tok                = tokNONE;
-    bool        is_expression      = false;
-    bool        new_statement      = true;
-    bool        done               = false;
-
-
-#define STACK_PUSH(op, arg, prio)                       \
-    do                                                  \
-    {                                                   \
-        pending_t pending = { (op), (arg), (prio) };    \
-        if (pending.opcode)                             \
-            name_ref(pending.opcode);                   \
-        tree_ref(pending.argument);                     \
-        pending_stack_push(&stack, pending);            \
-    } while (0)
-
-    // Check priorities compared to stack
-    // A + B * C, we got '*': keep "A+..." on stack
-    // Odd priorities are made right-associative by turning the
-    // low-bit off (with ~1) in the comparison below
+    name_p      block_opening;          // Opening of the block, e.g. (
+    name_p      block_closing;          // Closing of the block, e.g. )
+    int         block_priority;         // Priority of the block
+    syntax_p    syntax;                 // Syntax used within the block
+    tree_p      result;                 // Current result
+    tree_p      left;                   // Left of an infix being parsed
+    tree_p      right;                  // Last operand read
+    name_p      infix;                  // Infix being parsed
+    name_p      name;                   // Last name read
+    name_p      opening;                // Opening of a child block
+    name_p      closing;                // Closing of a child block
+    name_p      separator;              // Separator for items in block
+    syntax_p    child_syntax;           // Syntax of a child block
+    name_p      child_syntax_end;       // Closing for child syntax
+    srcpos_t    pos;                    // Position of the last token
+    srcpos_t    block_pos;              // Position of the block
+    srcpos_t    infix_pos;              // Position of the infix
+    srcpos_t    name_pos;               // Position of the name
+    srcpos_t    result_pos;             // Position of the result
+    srcpos_t    separator_pos;          // Position of the first separator
+    size_t      stack_base;             // Depth of the pending stack
+    size_t      items_base;             // Depth of the items stack
+    int         result_priority;        // Priority of the result
+    int         prefix_priority;        // Priority of the last prefix
+    int         infix_priority;         // Priority of the last infix
+    unsigned    old_indent;             // Indent to restore after a child
+    unsigned    lex;                    // Lexing threads after a child
+    token_t     tok;                    // Last token read
+    bool        is_expression;          // Parsing an expression
+    bool        new_statement;          // Beginning a new statement
+    bool        done;                   // End of the block was reached
+} parser_frame_t, *parser_frame_p;
+
+
+// Push a pending operation
+#define STACK_PUSH(op, arg, prio, opos)                         \
+    parser_push(p, (op), (arg), (prio), (opos))
+
+// Check priorities compared to stack
+// A + B * C, we got '*': keep "A+..." on stack
+// Odd priorities are made right-associative by turning the
+// low-bit off (with ~1) in the comparison below
 #define STACK_FLUSH(target)                                             \
     do                                                                  \
     {                                                                   \
-        while (pending_stack_length(stack))                             \
+        while (p->stack_depth > f->stack_base)                          \
         {                                                               \
-            pending_t prev = pending_stack_top(stack);                  \
+            pending_t prev = p->stack[p->stack_depth - 1];              \
                                                                         \
-            if (!done &&                                                \
+            if (!f->done &&                                             \
                 prev.priority != default_priority &&                    \
-                infix_priority > (prev.priority & ~1))                  \
+                f->infix_priority > (prev.priority & ~1))               \
                 break;                                                  \
             if (prev.opcode == NULL) /* Prefix */                       \
             {                                                           \
                 tree_set(&target,                                       \
-                         parser_pfix_new(prev.argument, target));       \
+                         parser_pfix_new(prev.position,                 \
+                                         prev.argument, target));       \
             }                                                           \
             else                                                        \
             {                                                           \
                 tree_set(&target, (tree_p)                              \
-                         infix_new(name_position(prev.opcode),          \
+                         infix_new(prev.position,                       \
                                    prev.opcode,                         \
                                    prev.argument,                       \
                                    target));                            \
                 name_dispose(&prev.opcode);                             \
             }                                                           \
             tree_dispose(&prev.argument);                               \
-            pending_stack_pop(&stack);                                  \
+            p->stack_depth--;                                           \
         }                                                               \
     } while(0)
 
+
+static parser_frame_p parser_frame_push(parser_p p,
+                                        name_p   block_opening,
+                                        name_p   block_closing,
+                                        int      block_priority)
+// ----------------------------------------------------------------------------
+//   Begin parsing a block, using the current syntax of the scanner
+// ----------------------------------------------------------------------------
+{
+    if (p->frames_depth == p->frames_capacity)
+    {
+        p->frames_capacity = p->frames_capacity ? 2*p->frames_capacity : 16;
+        p->frames = realloc(p->frames,
+                            p->frames_capacity * sizeof(parser_frame_t));
+    }
+
+    srcpos_t       pos    = parser_scanned_position(p);
+    syntax_p       syntax = p->scanner->syntax;
+    parser_frame_p f      = &p->frames[p->frames_depth++];
+    memset(f, 0, sizeof(*f));
+    f->block_opening   = name_use(block_opening);
+    f->block_closing   = name_use(block_closing);
+    f->block_priority  = block_priority;
+    f->syntax          = syntax_use(syntax);
+    f->pos             = pos;
+    f->block_pos       = pos;
+    f->infix_pos       = pos;
+    f->name_pos        = pos;
+    f->result_pos      = pos;
+    f->separator_pos   = pos;
+    f->stack_base      = p->stack_depth;
+    f->items_base      = p->items_depth;
+    f->result_priority = syntax->default_priority;
+    f->tok             = tokNONE;
+    f->new_statement   = true;
+
     if (block_opening)
     {
         assert(block_closing && "Block needs opening and closing");
         assert(syntax_infix_priority(syntax, block_opening) == block_priority);
         assert(syntax_infix_priority(syntax, block_closing) == block_priority);
 
-        // We are creating a block for everything inside
-        block = block_use(block_new(pos, block_opening, block_closing));
-
         // When inside a () block, we are in 'expression' mode right away
-        if (block_priority > statement_priority)
+        if (block_priority > syntax->statement_priority)
+        {
+            f->new_statement = false;
+            f->is_expression = true;
+        }
+    }
+    return f;
+}
+
+
+static tree_p parser_frame_pop(parser_p p)
+// ----------------------------------------------------------------------------
+//   Finish parsing the innermost block, and return the tree for it
+// ----------------------------------------------------------------------------
+{
+    parser_frame_p f                = &p->frames[p->frames_depth - 1];
+    int            default_priority = f->syntax->default_priority;
+    tree_p         result           = f->result;
+    f->result = NULL;
+
+    if (p->stack_depth > f->stack_base)
+    {
+        if (!result)
         {
-            new_statement = false;
-            is_expression = true;
+            pending_t last = p->stack[p->stack_depth - 1];
+            if (last.opcode && !name_eq(last.opcode, "\n"))
+                tree_set(&result, (tree_p)
+                         postfix_new(f->pos, last.argument, last.opcode));
+            else
+                tree_set(&result, last.argument);
+            name_dispose(&last.opcode);
+            tree_dispose(&last.argument);
+            p->stack_depth--;
         }
+
+        // Check if some stuff remains on stack
+        STACK_FLUSH(result);
     }
+    assert(p->stack_depth == f->stack_base && "Pending operations left");
+
+    if (f->block_opening)
+    {
+        // Create the block with all its items at once
+        if (result)
+            parser_push_item(p, result);
+        size_t count = p->items_depth - f->items_base;
+        tree_p *items = p->items + f->items_base;
+        block_p block = block_make(block_handler, f->block_pos,
+                                   f->block_opening, f->block_closing,
+                                   f->separator, count, items);
+        tree_set(&result, (tree_p) block);
+        while (p->items_depth > f->items_base)
+            tree_dispose(&p->items[--p->items_depth]);
+    }
+
+    name_dispose(&f->block_opening);
+    name_dispose(&f->block_closing);
+    tree_dispose(&f->left);
+    tree_dispose(&f->right);
+    name_dispose(&f->infix);
+    name_dispose(&f->name);
+    name_dispose(&f->opening);
+    name_dispose(&f->closing);
+    name_dispose(&f->separator);
+    syntax_dispose(&f->child_syntax);
+    name_dispose(&f->child_syntax_end);
+    syntax_dispose(&f->syntax);
+    if (result)
+        tree_unref(result);
+    p->frames_depth--;
+
+    return result;
+}
+
+
+static bool parser_too_deep(parser_p p, srcpos_t pos)
+// ----------------------------------------------------------------------------
+//   Check if a child block would exceed the maximum nesting depth
+// ----------------------------------------------------------------------------
+//   The outermost frame is not a block, so it does not count as nesting
+{
+    if (!p->depth_limit || p->frames_depth <= p->depth_limit)
+        return false;
+    if (!p->too_deep)
+        error(pos, "Blocks nested more than %zu levels deep", p->depth_limit);
+    p->too_deep = true;
+    return true;
+}
 
-    while (!done)
+
+static tree_p parser_block(parser_p p,
+                           name_p   block_opening,
+                           name_p   block_closing,
+                           int      block_priority)
+// ----------------------------------------------------------------------------
+//    Parse input until we reach block_end
+// ----------------------------------------------------------------------------
+// XL parsing is not very difficult, but a bit unusual, because it is based
+// solely on dynamic information and not, for instance, on keywords.
+// Consider the following cases, where p is "prefix-op" and i is "infix-op"
+//     Write A
+//       Parses as p(Write,A).
+//     A and B
+//       Parses as i(and,A,B) if 'and' has a priority,
+//              as p(A,p(and,B)) otherwise
+//     Write -A,B
+//       This parses as (Write-A),B since "-" has a priority.
+//       This one is fixed "artificially" by using spaces around -
+//       If there is a space before but not after, we parse as
+//           Write (-A), B
+//
+// Child blocks push a frame and continue in the same loop. When a child
+// is done, its result becomes the right operand of the enclosing block.
+{
+    scanner_p      scanner = p->scanner;
+    size_t         base    = p->frames_depth;
+    parser_frame_p f       = parser_frame_push(p, block_opening,
+                                               block_closing, block_priority);
+    bool           resumed = false;
+    text_p         source  = NULL;
+
+    while (true)
     {
+        if (f->done)
+        {
+            // Return the result of a child block to the enclosing block
+            tree_p child = parser_frame_pop(p);
+            if (p->frames_depth == base)
+                return child;
+            f = &p->frames[p->frames_depth - 1];
+            tree_set(&f->right, child);
+            if (f->tok == tokOPEN)
+            {
+                scanner_close_parenthese(scanner, f->old_indent);
+            }
+            else if (f->tok != tokINDENT)
+            {
+                scanner->syntax = f->syntax;
+                parser_lex(p, f->lex);
+            }
+            resumed = true;
+        }
+
+        syntax_p syntax             = f->syntax;
+        int      default_priority   = syntax->default_priority;
+        int      function_priority  = syntax->function_priority;
+        int      statement_priority = syntax->statement_priority;
+        int      prefix_vs_infix    = 0;
+        int      postfix_priority   = 0;
+        int      prio               = 0;
+
+        if (resumed)
+        {
+            resumed = false;
+            goto check_result;
+        }
+
         // Scan next token
-        tree_dispose(&right);
-        prefix_priority = infix_priority = default_priority;
-        tok = parser_token(p);
+        tree_dispose(&f->right);
+        f->prefix_priority = f->infix_priority = default_priority;
+        f->tok = parser_token(p);
 
         // Check token result
-        switch(tok)
+        switch(f->tok)
         {
         case tokEOF:
         case tokERROR:
-            done = true;
-            if (block && !name_eq(block_closing, SYNTAX_UNINDENT))
-                error(pos,
+            f->done = true;
+            if (f->block_opening && !p->over_budget && !p->too_deep &&
+                !name_eq(f->block_closing, SYNTAX_UNINDENT))
+                error(f->pos,
                       "Unexpected end of text, expected %t to close block",
-                      block_closing);
+                      f->block_closing);
             break;
         case tokINTEGER:
         case tokREAL:
         case tokCHARACTER:
         case tokTEXT:
         case tokLONGTEXT:
-            tree_set(&right, scanner->scanned.tree);
-            if (!result && new_statement)
-                is_expression = false;
-            prefix_priority = function_priority;
+            tree_set(&f->right, scanner->scanned.tree);
+            if (!f->result && f->new_statement)
+                f->is_expression = false;
+            f->prefix_priority = function_priority;
             break;
 
         case tokNEWLINE:
             // Consider new-line as an infix operator
-            name_set(&name, name_cnew(pos, "\n"));
+            name_set(&f->name, parser_newline);
+            f->name_pos = f->pos;
             goto common_symbols;
 
         case tokNAME:
         case tokSYMBOL:
-            name_set(&name, scanner->scanned.name);
+            name_set(&f->name, scanner->scanned.name);
+            f->name_pos = scanner->token_position;
 
         common_symbols:
-            if (block && name_compare(name, block_closing) == 0)
+            if (f->block_opening &&
+                name_compare(f->name, f->block_closing) == 0)
             {
-                done = true;
+                f->done = true;
                 break;
             }
-            else if ((child_syntax = syntax_is_special(syntax, name,
-                                                       &child_syntax_end)))
+            else if ((f->child_syntax =
+                      syntax_is_special(syntax, f->name,
+                                        &f->child_syntax_end)))
             {
-                // Read the input with the special syntax
-                int prio = syntax_infix_priority(syntax, name);
-                scanner->syntax = child_syntax;
-                tree_set(&right, parser_block(p, name, child_syntax_end, prio));
-                scanner->syntax = syntax;
+                if (parser_too_deep(p, f->pos))
+                {
+                    f->done = true;
+                    break;
+                }
+
+                // Read the input with the special syntax, not lexed ahead
+                prio = syntax_infix_priority(syntax, f->name);
+                f->lex = parser_lex(p, 0);
+                scanner->syntax = f->child_syntax;
+                f = parser_frame_push(p, f->name, f->child_syntax_end, prio);
+                continue;
             }
-            else if (!result)
+            else if (!f->result)
             {
-                prefix_priority = syntax_prefix_priority(syntax, name);
-                tree_set(&right, (tree_p) name);
-                if (prefix_priority == default_priority)
-                    prefix_priority = function_priority;
-                if (new_statement && tok == tokNAME)
-                    is_expression = false;
+                f->prefix_priority = syntax_prefix_priority(syntax, f->name);
+                tree_set(&f->right, (tree_p) f->name);
+                if (f->prefix_priority == default_priority)
+                    f->prefix_priority = function_priority;
+                if (f->new_statement && f->tok == tokNAME)
+                    f->is_expression = false;
             }
-            else if (left)
+            else if (f->left)
             {
                 // This is the right of an infix operator
                 // If we have "A and not B", where "not" has
                 // higher priority than "and", we want to
                 // parse this as "A and (not B)" rather than as
                 // "(A and not) B"
-                prefix_priority = syntax_prefix_priority(syntax, name);
-                tree_set(&right, (tree_p) name);
-                if (prefix_priority == default_priority)
-                    prefix_priority = function_priority;
+                f->prefix_priority = syntax_prefix_priority(syntax, f->name);
+                tree_set(&f->right, (tree_p) f->name);
+                if (f->prefix_priority == default_priority)
+                    f->prefix_priority = function_priority;
             }
             else
             {
                 // Complicated case: need to discriminate infix and prefix
-                infix_priority = syntax_infix_priority(syntax, name);
-                prefix_vs_infix = syntax_prefix_priority(syntax, name);
-                if (infix_priority != default_priority &&
+                f->infix_priority = syntax_infix_priority(syntax, f->name);
+                prefix_vs_infix = syntax_prefix_priority(syntax, f->name);
+                if (f->infix_priority != default_priority &&
                     (prefix_vs_infix == default_priority ||
                      !p->had_space_before || p->had_space_after))
                 {
                     // If this infix matches the current block, append it
-                    if (block && block_priority == infix_priority)
+                    if (f->block_opening &&
+                        f->block_priority == f->infix_priority)
                     {
                         // Check that we have consistent separators within block
-                        if (!block->separator)
+                        if (!f->separator)
                         {
-                            block->separator = name_use(name);
+                            f->separator = name_use(f->name);
+                            f->separator_pos = f->name_pos;
                         }
-                        else if (name_compare(block->separator, name) != 0)
+                        else if (name_compare(f->separator, f->name) != 0)
                         {
-                            error(pos, "Inconsistent separator in block: "
-                                  "had %t, now %t", block->separator, name);
-                            error(name_position(block->separator),
-                                  "This is where separator %t was found",
-                                  block->separator);
+                            error(f->pos, "Inconsistent separator in block: "
+                                  "had %t, now %t", f->separator, f->name);
+                            if (f->separator_pos)
+                                error(f->separator_pos,
+                                      "This is where separator %t was found",
+                                      f->separator);
                         }
-                        block_append_data(&block, 1, &result);
+                        parser_push_item(p, f->result);
 
                         // Restart with next item
-                        tree_set(&result, NULL);
+                        tree_set(&f->result, NULL);
                     }
                     else
                     {
                         // We got an infix
-                        tree_set(&left, result);
-                        name_set(&infix, name);
+                        tree_set(&f->left, f->result);
+                        name_set(&f->infix, f->name);
+                        f->infix_pos = f->name_pos;
                     }
                 }
                 else
                 {
-                    postfix_priority = syntax_postfix_priority(syntax, name);
+                    postfix_priority = syntax_postfix_priority(syntax,
+                                                               f->name);
                     if (postfix_priority != default_priority)
                     {
                         // We have a postfix operator
-                        tree_set(&right, (tree_p) name);
+                        tree_set(&f->right, (tree_p) f->name);
 
                         // Flush higher priority items on stack
                         // This is the case for X:integer!
-                        STACK_FLUSH(result);
+                        STACK_FLUSH(f->result);
 
-                        tree_set(&right, (tree_p)
-                                 postfix_new(pos, result, (name_p) right));
-                        prefix_priority = postfix_priority;
-                        tree_dispose(&result);
+                        tree_set(&f->right, (tree_p)
+                                 postfix_new(f->pos, f->result,
+                                             (name_p) f->right));
+                        f->prefix_priority = postfix_priority;
+                        tree_dispose(&f->result);
                     }
                     else
                     {
                         // No priority: take this as a prefix by default
-                        tree_set(&right, (tree_p) name);
-                        prefix_priority = prefix_vs_infix;
-                        if (prefix_priority == default_priority)
+                        tree_set(&f->right, (tree_p) f->name);
+                        f->prefix_priority = prefix_vs_infix;
+                        if (f->prefix_priority == default_priority)
                         {
-                            prefix_priority = function_priority;
-                            if (new_statement && tok == tokNAME)
-                                is_expression = false;
+                            f->prefix_priority = function_priority;
+                            if (f->new_statement && f->tok == tokNAME)
+                                f->is_expression = false;
                         }
                     }
                 }
@@ -539,171 +910,181 @@ static tree_p parser_block(parser_p p,
             break;
         case tokCLOSE:
             // Check for mismatched parenthese here
-            if (name_compare(scanner->scanned.name, block_closing) != 0)
-                error(pos, "Mismatched parentheses: got %t, expected %t",
-                      scanner->scanned.name, block_closing);
-            done = true;
+            if (name_compare(scanner->scanned.name, f->block_closing) != 0)
+                error(f->pos, "Mismatched parentheses: got %t, expected %t",
+                      scanner->scanned.name, f->block_closing);
+            f->done = true;
             break;
         case tokUNINDENT:
             // Check for mismatched blocks here
-            if (!name_eq(block_closing, SYNTAX_UNINDENT))
-                error(pos, "Mismatched identation, expected %t", block_closing);
-            done = true;
+            if (!name_eq(f->block_closing, SYNTAX_UNINDENT))
+                error(f->pos, "Mismatched identation, expected %t",
+                      f->block_closing);
+            f->done = true;
             break;
         case tokINDENT:
-            name_set(&scanner->scanned.name, name_cnew(pos, SYNTAX_INDENT));
+            name_set(&scanner->scanned.name, parser_indent);
             // Intentionally fall-through
 
         case tokOPEN:
-            name_set(&opening, scanner->scanned.name);
-            if (!syntax_is_block(syntax, opening, &closing))
+            if (parser_too_deep(p, f->pos))
+            {
+                f->done = true;
+                break;
+            }
+            name_set(&f->opening, scanner->scanned.name);
+            if (!syntax_is_block(syntax, f->opening, &f->closing))
                 assert(!"Internal error: Unknown parenthese type");
-            if (tok == tokOPEN)
-                old_indent = scanner_open_parenthese(scanner);
-            prefix_priority = syntax_infix_priority(syntax, opening);
+            if (f->tok == tokOPEN)
+                f->old_indent = scanner_open_parenthese(scanner);
+            f->prefix_priority = syntax_infix_priority(syntax, f->opening);
 
             // Just like for names, parse the contents of the parentheses
-            infix_priority = default_priority;
-            tree_set(&right, parser_block(p, opening,closing, prefix_priority));
-            if (tok == tokOPEN)
-                scanner_close_parenthese(scanner, old_indent);
-            break;
+            f->infix_priority = default_priority;
+            f = parser_frame_push(p, f->opening, f->closing,
+                                  f->prefix_priority);
+            continue;
         default:
-            error(pos, "Unknown token for %t, value %u", scanner->source, tok);
+            source = text_use(parser_source(p));
+            error(f->pos, "Unknown token for %t, value %u", source, f->tok);
+            text_dispose(&source);
             break;
         } // switch(tok)
 
 
+    check_result:
         // Check what is the current result
-        if (!result)
+        if (!f->result)
         {
             // First thing we parse
-            tree_set(&result, right);
-            result_priority = prefix_priority;
+            tree_set(&f->result, f->right);
+            f->result_pos = parser_position(f->right, f->name, f->name_pos);
+            f->result_priority = f->prefix_priority;
 
             // We are now in the middle of an expression
-            if (result && result_priority >= statement_priority)
-                new_statement= false;
+            if (f->result && f->result_priority >= statement_priority)
+                f->new_statement= false;
         }
-        else if (left)
+        else if (f->left)
         {
             // Check if we had a statement separator
-            if (infix_priority < statement_priority)
+            if (f->infix_priority < statement_priority)
             {
-                new_statement = true;
-                is_expression = false;
+                f->new_statement = true;
+                f->is_expression = false;
             }
 
             // We got left and infix-op, we are now looking for right
             // If we have 'A and not B', where 'not' has higher priority
             // than 'and', we want to finish parsing 'not B' first, rather
             // than seeing this as '(A and not) B'.
-            if (prefix_priority != default_priority)
+            if (f->prefix_priority != default_priority)
             {
                 // Push "A and" in the above example
-                STACK_PUSH(infix, left, infix_priority);
-                left = NULL;
+                STACK_PUSH(f->infix, f->left, f->infix_priority, f->infix_pos);
+                f->left = NULL;
 
                 // Start over with "not"
-                tree_set(&result, right);
-                result_priority = prefix_priority;
+                tree_set(&f->result, f->right);
+                f->result_pos = parser_position(f->right, f->name, f->name_pos);
+                f->result_priority = f->prefix_priority;
             }
             else
             {
-                STACK_FLUSH(left);
+                STACK_FLUSH(f->left);
 
                 // Now, we want to restart with the rightmost operand
-                if (done)
+                if (f->done)
                 {
                     // End of text: the result is what we just got
-                    tree_set(&result, left);
+                    tree_set(&f->result, f->left);
                 }
                 else
                 {
                     // Something like A+B+C, just got second +
-                    STACK_PUSH(infix, left, infix_priority);
-                    tree_set(&result, NULL);
+                    STACK_PUSH(f->infix, f->left,
+                               f->infix_priority, f->infix_pos);
+                    tree_set(&f->result, NULL);
                 }
-                tree_dispose(&left);
+                tree_dispose(&f->left);
             }
         }
-        else if (right)
+        else if (f->right)
         {
             // Check if we had a low-priority prefix (e.g. pragmas)
-            if (prefix_priority < statement_priority)
+            if (f->prefix_priority < statement_priority)
             {
-                new_statement = true;
-                is_expression = false;
+                f->new_statement = true;
+                f->is_expression = false;
             }
 
             // Check priorities for something like "A.B x,y" -> "(A.B) (x,y)"
             // Odd priorities are made right associative by turning the
             // low bit off for the previous priority
-            if (prefix_priority <= result_priority)
+            if (f->prefix_priority <= f->result_priority)
             {
-                STACK_FLUSH(result);
+                STACK_FLUSH(f->result);
             }
 
             // Check if new statement
-            if (!is_expression)
-                if (result_priority > statement_priority)
-                    if (pending_stack_length(stack) == 0 ||
-                        pending_stack_top(stack).priority < statement_priority)
-                        result_priority = statement_priority;
+            if (!f->is_expression)
+                if (f->result_priority > statement_priority)
+                    if (p->stack_depth == f->stack_base ||
+                        p->stack[p->stack_depth-1].priority <
+                        statement_priority)
+                        f->result_priority = statement_priority;
 
             // Push a recognized prefix op
-            STACK_PUSH(NULL, result, result_priority);
-            tree_set(&result, right);
-            result_priority = prefix_priority;
+            // The result may have been flushed, only names keep result_pos
+            if (!name_cast(f->result))
+                f->result_pos = tree_position(f->result);
+            STACK_PUSH(NULL, f->result, f->result_priority, f->result_pos);
+            tree_set(&f->result, f->right);
+            f->result_pos = parser_position(f->right, f->name, f->name_pos);
+            f->result_priority = f->prefix_priority;
         }
 
         // Retrieve the position for the next round
-        pos = position(positions);
-    } // While(!done)
-
-    if (pending_stack_length(stack))
-    {
-        if (!result)
-        {
-            pending_t last = pending_stack_top(stack);
-            if (last.opcode && !name_eq(last.opcode, "\n"))
-                tree_set(&result, (tree_p)
-                         postfix_new(pos, last.argument, last.opcode));
-            else
-                tree_set(&result, last.argument);
-            name_dispose(&last.opcode);
-            tree_dispose(&last.argument);
-            pending_stack_pop(&stack);
-        }
-
-        // Check if some stuff remains on stack
-        STACK_FLUSH(result);
-    }
+        f->pos = parser_scanned_position(p);
+    } // while (true)
+}
 
-    pending_stack_dispose(&stack);
 
-    if (block)
+static void parser_materialize(tree_p root)
+// ----------------------------------------------------------------------------
+//   Copy the data of lazy texts in a parsed tree
+// ----------------------------------------------------------------------------
+//   Lazy texts point into the mapped source, which the tree may outlive,
+//   and copying them on first access modifies trees that other threads
+//   might read. They are copied before the tree is returned to the caller,
+//   so that only tokens dropped while parsing, e.g. comments, stay lazy.
+{
+    size_t   depth = 0;
+    size_t   max_depth = 64;
+    tree_p  *stack = malloc(max_depth * sizeof(tree_p));
+    stack[depth++] = root;
+    while (depth)
     {
-        if (result)
-            block_append_data(&block, 1, &result);
-        tree_set(&result, (tree_p) block);
-        block_dispose(&block);
-    }
+        tree_p tree = stack[--depth];
+        if (!tree || tree->refcount >= TREE_SHARED)
+            continue;
 
-    tree_dispose(&left);
-    tree_dispose(&right);
-    name_dispose(&infix);
-    name_dispose(&name);
-    name_dispose(&opening);
-    name_dispose(&closing);
-    pending_stack_dispose(&stack);
-    syntax_dispose(&child_syntax);
-    name_dispose(&child_syntax_end);
-    syntax_dispose(&syntax);
-    if (result)
-        tree_unref(result);
+        blob_p blob = tree_cast(blob, tree);
+        if (blob)
+            blob_data(blob);
 
-    return result;
+        size_t arity = tree_arity(tree);
+        tree_p *children = tree_children(tree);
+        if (depth + arity > max_depth)
+        {
+            while (depth + arity > max_depth)
+                max_depth *= 2;
+            stack = realloc(stack, max_depth * sizeof(tree_p));
+        }
+        while (arity--)
+            stack[depth++] = children[arity];
+    }
+    free(stack);
 }
 
 
@@ -711,6 +1092,25 @@ tree_p parser_parse(parser_p p)
 // ----------------------------------------------------------------------------
 //   Parse input from the given parser
 // ----------------------------------------------------------------------------
+//   If a budget was set, allocations during parsing are charged to it.
+//   When it is exceeded, parsing stops and partial trees are released.
 {
-    return parser_block(p, NULL, NULL, 0);
+    tree_budget_p outer = NULL;
+    if (p->budget.limit)
+    {
+        p->budget.used = 0;
+        p->budget.allocations = 0;
+        p->budget.exceeded = false;
+        outer = tree_set_budget(&p->budget);
+    }
+
+    tree_p result = parser_block(p, NULL, NULL, 0);
+    if (p->over_budget)
+        tree_dispose(&result);
+    else
+        parser_materialize(result);
+
+    if (p->budget.limit)
+        tree_set_budget(outer);
+    return result;
 }
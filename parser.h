@@ -87,14 +87,32 @@ typedef struct parser
     scanner_p   scanner;
     text_p      comment;
     token_t     pending;
+    tree_budget_t budget;               // Memory budget for parsing
+    scanner_tokens_p tokens;            // Tokens lexed ahead of parsing
+    unsigned    lex_threads;            // Threads lexing ahead, 0 for none
+    struct pending *stack;              // Pending operations, all blocks
+    size_t      stack_depth;            // Entries in use in the stack
+    size_t      stack_capacity;         // Entries allocated for the stack
+    tree_p *    items;                  // Items of the blocks being parsed
+    size_t      items_depth;            // Items in use
+    size_t      items_capacity;         // Items allocated
+    struct parser_frame *frames;        // Blocks being parsed, innermost last
+    size_t      frames_depth;           // Frames in use
+    size_t      frames_capacity;        // Frames allocated
+    size_t      depth_limit;            // Maximum nesting, 0 for unlimited
     bool        had_space_before : 1;
     bool        had_space_after  : 1;
     bool        beginning_line   : 1;
+    bool        over_budget      : 1;   // Parsing aborted, out of budget
+    bool        too_deep         : 1;   // Parsing aborted, nested too deep
 } parser_t, *parser_p;
 
 
 extern parser_p parser_new(const char *filename, positions_p, syntax_p);
 extern void     parser_delete(parser_p p);
+extern size_t   parser_budget(parser_p p, size_t limit);
+extern size_t   parser_depth(parser_p p, size_t limit);
+extern unsigned parser_lex(parser_p p, unsigned threads);
 extern tree_p   parser_parse(parser_p p);
 
 #endif // PARSER_H
@@ -20,9 +20,17 @@
 
 #include "position.h"
 #include "recorder.h"
+#include "utf8.h"
+#include "config.h"
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif // HAVE_SYS_MMAN_H
 
 RECORDER(position_warning, 16, "Warnings about position module in XL");
 
@@ -54,6 +62,10 @@ void positions_delete(positions_p p)
     while(f)
     {
         position_file_p prev = f->previous;
+#ifdef HAVE_SYS_MMAN_H
+        if (f->source)
+            munmap((void *) f->source, f->length);
+#endif // HAVE_SYS_MMAN_H
         free((void *) f->name);
         free(f);
         f = prev;
@@ -79,6 +91,29 @@ srcpos_t position_step(positions_p p)
 }
 
 
+srcpos_t position_advance(positions_p p, size_t count)
+// ----------------------------------------------------------------------------
+//   Advance the current global position by count, return old location
+// ----------------------------------------------------------------------------
+{
+    srcpos_t result = p->position;
+    p->position += count;
+    return result;
+}
+
+
+srcpos_t position_retreat(positions_p p, size_t count)
+// ----------------------------------------------------------------------------
+//   Move the current global position back by count, return old location
+// ----------------------------------------------------------------------------
+{
+    srcpos_t result = p->position;
+    assert(count <= result && "Cannot retreat before beginning of input");
+    p->position -= count;
+    return result;
+}
+
+
 
 // ============================================================================
 //
@@ -94,56 +129,123 @@ srcpos_t position_open_source_file(positions_p p, const char *name)
     position_file_p file = malloc(sizeof(position_file_t));
     file->name = strdup(name);
     file->start = position(p);
+    file->source = NULL;
+    file->length = 0;
     file->previous = p->last;
     p->last = file;
     return file->start;
 }
 
 
-bool position_info(positions_p p, srcpos_t pos, position_p result)
+const char *position_map_source_file(positions_p p, int fd, size_t *length)
 // ----------------------------------------------------------------------------
-// Converting a global position into position information
+//    Map the last opened source file in memory, return NULL if impossible
 // ----------------------------------------------------------------------------
+//    Only regular files can be mapped. Pipes, terminals or empty files
+//    return NULL, and the caller should fall back to buffered reads.
+//    The mapping is released when the positions are deleted.
 {
-    if (!p)
-        return false;
-
     position_file_p file = p->last;
-    position_file_p good = NULL;
+    if (!file || file->source)
+        return NULL;
+
+#ifdef HAVE_SYS_MMAN_H
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return NULL;
 
-    while (file && file->start <= pos)
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
     {
-        good = file;
-        file = file->previous;
+        record(position_warning, "Unable to map %s, size %zu",
+               file->name, size);
+        return NULL;
     }
-    if (!good)
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    file->source = data;
+    file->length = size;
+    *length = size;
+    return data;
+#else // !HAVE_SYS_MMAN_H
+    return NULL;
+#endif // HAVE_SYS_MMAN_H
+}
+
+
+bool position_info(positions_p p, srcpos_t pos, position_p result)
+// ----------------------------------------------------------------------------
+// Converting a global position into position information
+// ----------------------------------------------------------------------------
+{
+    if (!p)
         return false;
 
-    FILE *f = fopen(good->name, "rb");
-    if (!f)
+    // Files are listed from the last one opened, find the last before pos
+    position_file_p good = p->last;
+    while (good && good->start > pos)
+        good = good->previous;
+    if (!good)
         return false;
 
     unsigned offset = pos - good->start;
     result->position = pos;
     result->file = good->name;
     result->offset = offset;
+    result->source = good->source;
 
     unsigned line = 1;
     unsigned line_offset = 0;
     unsigned current = 0;
+
+    // If the file is mapped, scan the mapping directly
+    if (good->source)
+    {
+        const char *source = good->source;
+        size_t length = good->length;
+        if (offset > length)
+            offset = length;
+        while (current < offset)
+        {
+            const char *eol = memchr(source + current, '\n', offset - current);
+            if (!eol)
+                break;
+            current = eol - source + 1;
+            line_offset = current;
+            line++;
+        }
+        result->line = line;
+        result->line_offset = line_offset;
+        result->column = utf8_count(source + line_offset, offset - line_offset)
+            + (result->offset - offset);
+        const char *eol = memchr(source + line_offset, '\n',
+                                 length - line_offset);
+        current = eol ? (size_t) (eol - source) : length;
+        result->line_length = current - line_offset;
+        return true;
+    }
+
+    FILE *f = fopen(good->name, "rb");
+    if (!f)
+        return false;
+
+    unsigned column = 0;
     while (current < offset && !feof(f))
     {
         int c = fgetc(f);
         current++;
+        column += !utf8_is_next(c);
         if (c == '\n')
         {
             line_offset = current;
+            column = 0;
             line++;
         }
     }
     result->line = line;
     result->line_offset = line_offset;
-    result->column = offset - line_offset;
+    result->column = column + (offset - current);
     while (!feof(f))
     {
         int c = fgetc(f);
@@ -162,12 +264,19 @@ bool position_source(position_p posinfo, char *buffer, size_t size)
 //   Read the source code based on the position information into target buffer
 // ----------------------------------------------------------------------------
 {
+    if (size > posinfo->line_length + 1)
+        size = posinfo->line_length + 1;
+    if (posinfo->source)
+    {
+        memcpy(buffer, posinfo->source + posinfo->line_offset, size-1);
+        buffer[size-1] = 0;
+        return true;
+    }
+
     FILE *f = fopen(posinfo->file, "rb");
     if (!f)
         return false;
     fseek(f, posinfo->line_offset, SEEK_SET);
-    if (size > posinfo->line_length + 1)
-        size = posinfo->line_length + 1;
     size_t rs = fread(buffer, 1, size-1, f);
     if (rs != size-1)
         record(position_warning, "Reading %s offset %zu read %zu of %zu bytes",
@@ -37,9 +37,10 @@ typedef struct position
     const char * file;          // File name
     unsigned     offset;        // Offset in file
     unsigned     line;          // Line number in file
-    unsigned     column;        // Column in file
+    unsigned     column;        // Column in file, in code points
     unsigned     line_offset;   // Beginning of line
     unsigned     line_length;   // Length of source code
+    const char * source;        // Mapped source code, or NULL
 } position_t, *position_p;
 
 
@@ -50,6 +51,8 @@ typedef struct position_file
 {
     const char *          name;
     srcpos_t              start;
+    const char *          source;       // Memory-mapped source, if any
+    size_t                length;       // Length of mapped source
     struct position_file *previous;
 } position_file_t, *position_file_p;
 
@@ -71,9 +74,12 @@ void        positions_delete(positions_p p);
 // Getting and stepping the current global position
 srcpos_t position(positions_p p);
 srcpos_t position_step(positions_p p);
+srcpos_t position_advance(positions_p p, size_t count);
+srcpos_t position_retreat(positions_p p, size_t count);
 
 // Opening and closing source files
 srcpos_t position_open_source_file(positions_p p, const char *name);
+const char *position_map_source_file(positions_p p, int fd, size_t *length);
 
 // Converting a global position into position information
 bool     position_info(positions_p p, srcpos_t pos, position_p result);
@@ -30,6 +30,15 @@
 #include <ctype.h>
 
 
+// Default formats and comment terminators
+text_static(renderer_cr,          "\n");
+text_static(renderer_space,       " ");
+text_static(renderer_indent,      "indent");
+text_static(renderer_begin,       "begin");
+text_static(renderer_end,         "end");
+name_static(renderer_c_comment,   "*/");
+name_static(renderer_cpp_comment, "\n");
+
 
 // ============================================================================
 //
@@ -82,11 +91,11 @@ renderer_p renderer_new(const char *style)
     memset(result, 0, sizeof(renderer_t));
     if (style)
     {
-        text_set(&result->cr, text_cnew(0, "\n"));
-        text_set(&result->space, text_cnew(0, " "));
-        text_set(&result->indent, text_cnew(0, "indent"));
-        text_set(&result->begin, text_cnew(0, "begin"));
-        text_set(&result->end, text_cnew(0, "end"));
+        text_set(&result->cr, renderer_cr);
+        text_set(&result->space, renderer_space);
+        text_set(&result->indent, renderer_indent);
+        text_set(&result->begin, renderer_begin);
+        text_set(&result->end, renderer_end);
         renderer_style(result, style);
     }
     return result;
@@ -171,8 +180,8 @@ void renderer_style(renderer_p renderer, const char  *style)
     array_p      format          = NULL;
     array_p      formats         = array_use(array_new(0, 0, NULL));
     token_t      token           = tokNONE;
-    name_p       end_c_comment   = name_cnew(0, "*/");
-    name_p       end_cpp_comment = name_cnew(0, "\n");
+    name_p       end_c_comment   = renderer_c_comment;
+    name_p       end_cpp_comment = renderer_cpp_comment;
     unsigned     indent          = 0;
     bool         done            = false;
     srcpos_t     equal_pos       = 0;
@@ -190,7 +199,7 @@ void renderer_style(renderer_p renderer, const char  *style)
         case tokCHARACTER:
         case tokSYMBOL:
         case tokNAME:
-            text_set(&source, scanner->source);
+            text_set(&source, scanner_source(scanner));
 
             if (eq(source, "="))
             {
@@ -258,7 +267,8 @@ void renderer_style(renderer_p renderer, const char  *style)
 
         default:
             // Any other stuff (indents, etc) is skipped
-            error(position(positions), "Unexpected token %t", scanner->source);
+            error(position(positions), "Unexpected token %t",
+                  scanner_source(scanner));
             break;
         } // switch
 
@@ -22,19 +22,114 @@
 #define SCANNER_C
 #include "scanner.h"
 
+#include "config.h"
+#include "delimited_text.h"
 #include "error.h"
 #include "name.h"
 #include "recorder.h"
 #include "utf8.h"
 
 #include <assert.h>
-#include <ctype.h>
+#include <float.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif // HAVE_LIBPTHREAD
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif // HAVE_SYS_STAT_H
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 RECORDER(SCANNER, 64, "Recording tokens that were scanned");
 
+static char *scanner_reserve(scanner_p s, size_t size);
+static void scanner_validate(scanner_p s, size_t size, const char *data);
+static scanner_tokens_p scanner_cache_lex(scanner_p s, unsigned threads);
+
+
+
+// ============================================================================
+//
+//    Character classification
+//
+// ============================================================================
+
+#define SCANNER_TABLE4(F, c)                                            \
+    F(c),     F(c + 1),                                                 \
+    F(c + 2), F(c + 3)
+#define SCANNER_TABLE16(F, c)                                           \
+    SCANNER_TABLE4(F, c),     SCANNER_TABLE4(F, c + 4),                 \
+    SCANNER_TABLE4(F, c + 8), SCANNER_TABLE4(F, c + 12)
+#define SCANNER_TABLE64(F, c)                                           \
+    SCANNER_TABLE16(F, c),      SCANNER_TABLE16(F, c + 16),             \
+    SCANNER_TABLE16(F, c + 32), SCANNER_TABLE16(F, c + 48)
+#define SCANNER_TABLE(F)                                                \
+    SCANNER_TABLE64(F, 0x00), SCANNER_TABLE64(F, 0x40),                 \
+    SCANNER_TABLE64(F, 0x80), SCANNER_TABLE64(F, 0xC0)
+
+// Value of a byte as a digit in bases up to 36, 0xFF if not a digit
+#define SCANNER_DIGIT_VALUE(c)                                          \
+    ((c) >= '0' && (c) <= '9'   ? (c) - '0'                             \
+     : (c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 10                        \
+     : (c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 10                        \
+     : 0xFF)
+
+// Value of a byte as a base-64 digit (see https://en.wikipedia.org/wiki/Base64)
+#define SCANNER_BASE64_VALUE(c)                                         \
+    ((c) >= 'A' && (c) <= 'Z'   ? (c) - 'A'                             \
+     : (c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 26                        \
+     : (c) >= '0' && (c) <= '9' ? (c) - '0' + 52                        \
+     : (c) == '+'               ? 62                                    \
+     : (c) == '/'               ? 63                                    \
+     : 0xFF)
+
+// Exponents are saturated at this value, well beyond the range of numbers
+#define SCANNER_MAX_EXPONENT    100000
+
+const uint8_t scanner_classes[256] =
+// ----------------------------------------------------------------------------
+//   Class of each byte, replacing locale-dependent <ctype.h> calls
+// ----------------------------------------------------------------------------
+{
+    SCANNER_TABLE(SCANNER_CLASS)
+};
+
+
+static const uint8_t scanner_digit_values[256] =
+// ----------------------------------------------------------------------------
+//   Digit values for bases 2 to 36
+// ----------------------------------------------------------------------------
+//   Like the other tables, this is constant so that threads can share it
+{
+    SCANNER_TABLE(SCANNER_DIGIT_VALUE)
+};
+
+
+static const uint8_t scanner_base64_values[256] =
+// ----------------------------------------------------------------------------
+//   Digit values for base 64
+// ----------------------------------------------------------------------------
+{
+    SCANNER_TABLE(SCANNER_BASE64_VALUE)
+};
+
+#undef SCANNER_TABLE4
+#undef SCANNER_TABLE16
+#undef SCANNER_TABLE64
+#undef SCANNER_TABLE
+#undef SCANNER_DIGIT_VALUE
+#undef SCANNER_BASE64_VALUE
+
 
 
 // ============================================================================
@@ -53,19 +148,39 @@ scanner_p scanner_new(positions_p positions, syntax_p syntax)
     s->reader = NULL;
     s->stream = NULL;
     s->syntax = syntax_use(syntax);
+    s->cache = NULL;
     s->source = NULL;
+    s->skipped = NULL;
     s->scanned.text = NULL;
     s->indents = indents_new(position(positions), 0, NULL);
     s->block_close = NULL;
     s->indent = 0;
     s->column = 0;
-    s->pending_char[0] = 0;
-    s->pending_char[1] = 0;
+    s->buffer_size = SCANNER_HISTORY + SCANNER_BUFFER_SIZE;
+    s->buffer = malloc(s->buffer_size);
+    s->input = s->buffer;
+    s->input_length = 0;
+    s->input_next = 0;
+    s->pending = 0;
+    s->token_start = 0;
+    s->token_end = 0;
+    s->token_position = 0;
+    s->resume = 0;
+    s->resume_first = 0;
+    s->validated = 0;
+    s->utf8 = (utf8_state_t) { 0 };
     s->indent_char = 0;
     s->checking_indent = false;
     s->setting_indent = false;
     s->had_space_before = false;
     s->had_space_after = false;
+    s->input_eof = false;
+    s->pushed = false;
+    s->finished = false;
+    s->starved = false;
+    s->raw_indent = false;
+    s->packed = false;
+    s->invalid_utf8 = false;
     return s;
 }
 
@@ -76,10 +191,12 @@ void scanner_delete(scanner_p s)
 // ----------------------------------------------------------------------------
 {
     text_dispose(&s->source);
+    text_dispose(&s->skipped);
     tree_dispose(&s->scanned.tree);
     indents_dispose(&s->indents);
     name_dispose(&s->block_close);
     syntax_dispose(&s->syntax);
+    free(s->buffer);
     free(s);
 }
 
@@ -101,8 +218,22 @@ FILE *scanner_open(scanner_p s, const char *file)
 {
     FILE *f = fopen(file, "r");
     if (f)
+    {
         scanner_open_stream(s, file, scanner_file_read, f);
-    RECORD(SCANNER, "Open file '%s' = %p", file, f);
+
+        // If possible, scan directly from a memory mapping of the file
+        size_t length = 0;
+        const char *mapped = position_map_source_file(s->positions,
+                                                      fileno(f), &length);
+        if (mapped && fseek(f, length, SEEK_SET) == 0)
+        {
+            s->input = mapped;
+            s->input_length = length;
+            scanner_validate(s, length, mapped);
+        }
+        RECORD(SCANNER, "Open file '%s' = %p mapped %p length %zu",
+               file, f, mapped, length);
+    }
     return f;
 }
 
@@ -128,7 +259,21 @@ void scanner_open_stream(scanner_p s, const char *name,
     assert(s->reader == NULL && "Cannot open a scanner that is already open");
     s->reader = reader;
     s->stream = stream;
-    position_open_source_file(s->positions, name);
+    s->input = s->buffer;
+    s->input_length = 0;
+    s->input_next = 0;
+    s->pending = 0;
+    s->token_start = 0;
+    s->token_end = 0;
+    s->resume = 0;
+    s->input_eof = false;
+    s->pushed = false;
+    s->finished = false;
+    s->starved = false;
+    s->utf8 = (utf8_state_t) { 0 };
+    s->invalid_utf8 = false;
+    text_dispose(&s->skipped);
+    s->validated = position_open_source_file(s->positions, name);
 }
 
 
@@ -140,6 +285,49 @@ void scanner_close_stream(scanner_p s, void *stream)
     assert(stream == s->stream && "Only the current input can be closed");
     s->stream = NULL;
     s->reader = NULL;
+    s->pushed = false;
+}
+
+
+void scanner_open_push(scanner_p s, const char *name)
+// ----------------------------------------------------------------------------
+//   Open an input that will be pushed with scanner_feed
+// ----------------------------------------------------------------------------
+//   Tokens are returned by scanner_read as soon as they are complete.
+//   When the input fed so far ends within a token, scanner_read returns
+//   tokNONE, and scans the token again once the input fed may end it.
+//   scanner_skip similarly returns NULL, and continues where it stopped.
+{
+    scanner_open_stream(s, name, NULL, NULL);
+    s->pushed = true;
+}
+
+
+void scanner_feed(scanner_p s, size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Push more input to the scanner
+// ----------------------------------------------------------------------------
+{
+    assert(s->pushed && !s->finished && "Can only feed an open push input");
+    char *input = scanner_reserve(s, size);
+    memcpy(input, data, size);
+    s->input_length += size;
+    s->starved = false;
+    scanner_validate(s, size, input);
+    RECORD(SCANNER, "Feed %zu bytes", size);
+}
+
+
+void scanner_finish(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Indicate that no more input will be pushed to the scanner
+// ----------------------------------------------------------------------------
+{
+    assert(s->pushed && "Can only finish a push input");
+    scanner_validate(s, 0, NULL);
+    s->finished = true;
+    s->starved = false;
+    RECORD(SCANNER, "Finish pushed input");
 }
 
 
@@ -150,27 +338,124 @@ void scanner_close_stream(scanner_p s, void *stream)
 //
 // ============================================================================
 
-static int scanner_getchar(scanner_p s)
+static char *scanner_reserve(scanner_p s, size_t size)
 // ----------------------------------------------------------------------------
-//   Read next character from scanner
+//   Make room for size more bytes of input, return where to write them
 // ----------------------------------------------------------------------------
+//   The last few characters read are kept in front of the new input, so
+//   that scanner_ungetchar can step back across chunks. The spelling of the
+//   token being scanned is also kept, growing the buffer if the token is
+//   larger than a chunk. Input from a memory mapping is copied to the buffer.
 {
-    char c = s->pending_char[0];
-    if (c)
+    size_t first = s->input_next > SCANNER_HISTORY
+        ? s->input_next - SCANNER_HISTORY
+        : 0;
+    if (first > s->token_start)
+        first = s->token_start;
+    size_t keep = s->input_length - first;
+    const char *kept = s->input + first;
+    if (keep + size > s->buffer_size)
     {
-        s->pending_char[0] = s->pending_char[1];
-        s->pending_char[1] = 0;
-        return c;
+        bool buffered = s->input == s->buffer;
+        s->buffer_size = keep + size;
+        s->buffer = realloc(s->buffer, s->buffer_size);
+        if (buffered)
+            kept = s->buffer + first;
+    }
+    memmove(s->buffer, kept, keep);
+    s->input = s->buffer;
+    s->input_length = keep;
+    s->input_next -= first;
+    s->token_start -= first;
+    s->token_end -= first;
+    if (s->resume)
+        s->resume -= first;
+    return s->buffer + keep;
+}
+
+
+static bool scanner_refill(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Read the next chunk of input into the scanner buffer
+// ----------------------------------------------------------------------------
+//   When the input was a memory mapping, we continue with buffered reads
+//   of whatever follows the mapped part of the stream.
+//   Pushed input is only at its end after scanner_finish. Before that,
+//   we record that the scanner is starved, waiting for scanner_feed.
+{
+    if (s->pushed)
+    {
+        if (s->finished)
+            s->pushed = false;
+        else
+            s->starved = true;
+        return false;
     }
     if (!s->reader)
-        return EOF;
-    unsigned size = s->reader(s->stream, 1, &c);
-    if (size != 1)
+        return false;
+
+    char *chunk = scanner_reserve(s, SCANNER_BUFFER_SIZE);
+    unsigned size = s->reader(s->stream, SCANNER_BUFFER_SIZE, chunk);
+    RECORD(SCANNER, "Refill %u bytes", size);
+    s->input_length += size;
+    scanner_validate(s, size, size ? chunk : NULL);
+    if (size == 0)
     {
         s->reader = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+static void scanner_validate(scanner_p s, size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Check that new input is valid UTF-8, NULL data marks the end of input
+// ----------------------------------------------------------------------------
+//   Input is checked once, as it is mapped, read or fed, so that malformed
+//   text is reported where it is, not where it confuses the scanner.
+//   Only the first invalid sequence is reported, since a file with one is
+//   likely to have many, e.g. if it was written in Latin-1.
+{
+    if (s->invalid_utf8)
+        return;
+
+    if (!data)
+    {
+        if (s->utf8.needed)
+        {
+            error(s->validated - s->utf8.seen,
+                  "Truncated UTF-8 sequence at end of input");
+            s->invalid_utf8 = true;
+        }
+        return;
+    }
+
+    size_t valid = utf8_validate(&s->utf8, data, size);
+    if (valid < size)
+    {
+        error(s->validated + valid - s->utf8.seen, "Invalid UTF-8 sequence");
+        s->invalid_utf8 = true;
+        RECORD(SCANNER, "Invalid UTF-8 at offset %zu of %zu", valid, size);
+    }
+    s->validated += size;
+}
+
+
+static inline int scanner_getchar(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Read next character from scanner
+// ----------------------------------------------------------------------------
+{
+    if (s->pending)
+        s->pending--;
+    if (s->input_next >= s->input_length && !scanner_refill(s))
+    {
+        s->input_eof = true;
         return EOF;
     }
-    return c;
+    s->input_eof = false;
+    return (char) s->input[s->input_next++];
 }
 
 
@@ -178,10 +463,16 @@ static inline void scanner_ungetchar(scanner_p s, char c)
 // ----------------------------------------------------------------------------
 //   Unget last character from input stream
 // ----------------------------------------------------------------------------
+//   The character is still in the input buffer, so we only step back,
+//   except for an end of file, which was never read from the buffer
 {
-    assert(s->pending_char[1] == 0 && "Max two pending char at a time");
-    s->pending_char[1] = s->pending_char[0];
-    s->pending_char[0] = c;
+    assert(s->pending < SCANNER_HISTORY && "Max two pending char at a time");
+    s->pending++;
+    if (c == EOF && s->input_eof)
+        return;
+    assert(s->input_next > 0 && s->input[s->input_next-1] == c &&
+           "Can only unget characters that were read");
+    s->input_next--;
 }
 
 
@@ -190,284 +481,929 @@ static inline unsigned scanner_position(scanner_p s)
 //   Return the current position, taking into account chars we returned
 // ----------------------------------------------------------------------------
 {
-    return position(s->positions)
-        - (s->pending_char[0] != 0)
-        - (s->pending_char[1] != 0);
+    return position(s->positions) - s->pending;
 }
 
 
-static inline void scanner_consume(scanner_p s, char c)
+static inline void scanner_consume(scanner_p s)
 // ----------------------------------------------------------------------------
-//   Update position and token input after consuming one character
+//   Update position and token spelling after consuming one character
 // ----------------------------------------------------------------------------
+//   The consumed character is always the last one read from the input,
+//   so the spelling is simply extended up to the current input position
 {
-    if (c)
-        text_append_data(&s->source, 1, &c);
+    if (!s->input_eof)
+        s->token_end = s->input_next;
     position_step(s->positions);
 }
 
 
-static inline int scanner_nextchar(scanner_p s, char c)
+static inline void scanner_spelling(scanner_p s, srcpos_t pos)
+// ----------------------------------------------------------------------------
+//   Start a new token spelling at the current input position
+// ----------------------------------------------------------------------------
+{
+    s->token_start = s->token_end;
+    s->token_position = pos;
+    text_dispose(&s->source);
+}
+
+
+static inline const char *scanner_token_data(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Return a pointer to the spelling of the current token in the input
+// ----------------------------------------------------------------------------
+{
+    return s->input + s->token_start;
+}
+
+
+static inline size_t scanner_token_length(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Return the length of the spelling of the current token
+// ----------------------------------------------------------------------------
+{
+    return s->token_end - s->token_start;
+}
+
+
+text_p scanner_source(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Return the source spelling of the current token, as a text
+// ----------------------------------------------------------------------------
+//   Tokens are only recorded as a span in the input, and the text is only
+//   created when some caller, e.g. an error message, actually needs it
+{
+    if (!s->source)
+        s->source = text_use(text_new(s->token_position,
+                                      scanner_token_length(s),
+                                      scanner_token_data(s)));
+    return s->source;
+}
+
+
+static inline int scanner_nextchar(scanner_p s)
 // ----------------------------------------------------------------------------
 //   Consume current character and get the next one
 // ----------------------------------------------------------------------------
 {
-    scanner_consume(s, c);
+    scanner_consume(s);
     return scanner_getchar(s);
 }
 
 
-static name_p scanner_normalize(text_p input)
+static int scanner_backtrack(scanner_p s, size_t length)
+// ----------------------------------------------------------------------------
+//   Shorten the token spelling to length, and return the next character
+// ----------------------------------------------------------------------------
+//   The characters given back are still in the input, since the spelling
+//   is preserved when refilling, so we only need to step back
+{
+    size_t end = s->token_start + length;
+    assert(end < s->token_end && "Can only backtrack within token spelling");
+    position_retreat(s->positions, s->token_end - end);
+    s->token_end = end;
+    s->input_next = end + 1;
+    s->input_eof = false;
+    return (char) s->input[end];
+}
+
+
+static name_p scanner_normalize(scanner_p s)
 // ----------------------------------------------------------------------------
-//   Create an output name that is the normalized variant of the input
+//   Create an output name that is the normalized variant of the spelling
 // ----------------------------------------------------------------------------
 //   For normalization, we convert everything to lowercase and skip '_' chars
+//   The result is interned, so that repeated names do not allocate
 {
-    const char *src = text_data(input);
-    unsigned size = text_length(input);
+    const char *src = scanner_token_data(s);
+    unsigned size = scanner_token_length(s);
     assert(name_is_valid(size, src) && "Normalizing invalid name");
 
     // Check for the relatively frequent case where input is already normalized
     // This happens for example with 'keywords' such as 'if' or 'then
     // in the way most people write code.
+    // Any '_' or uppercase character means the name must be rewritten
     bool normalized = true;
-    unsigned normalized_size = 0;
-    for (unsigned i = 0; i < size; i++)
+    for (unsigned i = 0; normalized && i < size; i++)
     {
         char c = src[i];
         bool relevant = c != '_';
-        normalized = relevant && c == tolower(c);
-        normalized_size += relevant;
+        normalized = normalized && relevant && !(c >= 'A' && c <= 'Z');
     }
     if (normalized)
-    {
-        // Force-cast text to name (assume otherwise identical representation)
-        name_p result = (name_p) input;
-        ((tree_p) result)->handler = name_handler;
-        return result;
-    }
+        return name_intern(size, src);
 
-    // It's not normalized. We need a new name to copy data into
-    name_p result = name_new(text_position(input), normalized_size, src);
-    char *dst = (char *) name_data(result);
+    // It's not normalized. Normalize in a local buffer if the name is short
+    char local[64];
+    char *normal = size <= sizeof(local) ? local : malloc(size);
+    char *dst = normal;
     for (unsigned i = 0; i < size; i++)
     {
         char c = src[i];
         if (c == '_')
             continue;
-        *dst++ = tolower(c);
+        *dst++ = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
     }
+    unsigned normalized_size = dst - normal;
+    name_p result = name_intern(normalized_size, normal);
+    if (normal != local)
+        free(normal);
     return result;
 }
 
 
-static character_p scanner_character(text_p text)
+static text_p scanner_text(scanner_p s, srcpos_t pos,
+                           char eos, bool terminated)
+// ----------------------------------------------------------------------------
+//   Build a text value from the spelling of a quoted text token
+// ----------------------------------------------------------------------------
+//   The spelling includes the quotes, and doubled quotes represent a quote.
+//   A text without doubled quotes in a mapped file is not copied until it
+//   is used. The parser copies the texts it keeps before returning a tree.
+{
+    const char *src = scanner_token_data(s) + 1;
+    size_t size = scanner_token_length(s) - 1 - terminated;
+    const char *end = src + size;
+    size_t doubled = 0;
+    for (const char *quote = memchr(src, eos, size);
+         quote && quote + 1 < end;
+         quote = memchr(quote + 2, eos, end - quote - 2))
+        doubled++;
+
+    if (!doubled)
+        return s->input != s->buffer
+            ? text_lazy(pos, size, src)
+            : text_new(pos, size, src);
+
+    text_p text = text_new(pos, size - doubled, NULL);
+    char *dst = text_data(text);
+    for (size_t i = 0; i < size; i++)
+    {
+        *dst++ = src[i];
+        if (src[i] == eos)
+            i++;
+    }
+    return text;
+}
+
+
+static unsigned scanner_character(text_p text)
 // ----------------------------------------------------------------------------
-//    Check if a character is valid and return it
+//    Check if a character is valid and return its code
 // ----------------------------------------------------------------------------
 {
     srcpos_t     pos    = text_position(text);
     char        *data   = text_data(text);
     size_t       len    = text_length(text);
     unsigned     code   = utf8_code(data, len);
-    character_p  result = character_new(pos, code);
 
     if (utf8_length(data, len) != 1)
         error(pos,"Character constant '%t' should contain one character",text);
 
-    return result;
+    return code;
 }
 
 
-token_t scanner_read(scanner_p s)
+static void scanner_natural(scanner_p s, srcpos_t pos,
+                            unsigned long long value)
 // ----------------------------------------------------------------------------
-//    Scan input and return current token
+//    Return an integer value, as a tree unless the scanner is packed
 // ----------------------------------------------------------------------------
 {
-    srcpos_t pos = scanner_position(s);
+    if (s->packed)
+        s->value.natural = value;
+    else
+        natural_set(&s->scanned.natural, natural_new(pos, value));
+}
 
-    // Create new source text and clear scanned tree if it was set earlier
-    text_set(&s->source, text_new(pos, 0, NULL));
-    tree_dispose(&s->scanned.tree);
 
-    // Check if we have something to read
-    if (!s->reader)
+static void scanner_real(scanner_p s, srcpos_t pos, double value)
+// ----------------------------------------------------------------------------
+//    Return a real value, as a tree unless the scanner is packed
+// ----------------------------------------------------------------------------
+{
+    if (s->packed)
+        s->value.real = value;
+    else
+        real_set(&s->scanned.real, real_new(pos, value));
+}
+
+
+static size_t scanner_blank_run(const char *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Return the number of blank characters at the beginning of data
+// ----------------------------------------------------------------------------
+//   Blanks are ' ' and '\t' to '\r'. For the latter, we subtract '\t'
+//   and check that the result is at most 4 as an unsigned byte.
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    for (; i + 32 <= size; i += 32)
     {
-        RECORD(SCANNER, "At pos %u return EOF", pos);
-        return tokEOF;
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i ctrl = _mm256_sub_epi8(bytes, tab);
+        __m256i blank = _mm256_or_si256(
+            _mm256_cmpeq_epi8(bytes, space),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(ctrl, four), ctrl));
+        uint32_t other = ~(uint32_t) _mm256_movemask_epi8(blank);
+        if (other)
+            return i + __builtin_ctz(other);
     }
-
-    // Check if we unindented far enough for multiple indents
-    s->had_space_before = true;
-    if (indents_length(s->indents) > 0 && indents_top(s->indents) > s->indent)
+#elif defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    for (; i + 16 <= size; i += 16)
     {
-        RECORD(SCANNER, "At pos %u return UNINDENT, indent %u > %u",
-               pos, indents_top(s->indents), s->indent);
-        indents_pop(&s->indents);
-        return tokUNINDENT;
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i ctrl = _mm_sub_epi8(bytes, tab);
+        __m128i blank = _mm_or_si128(
+            _mm_cmpeq_epi8(bytes, space),
+            _mm_cmpeq_epi8(_mm_min_epu8(ctrl, four), ctrl));
+        unsigned other = ~_mm_movemask_epi8(blank) & 0xFFFF;
+        if (other)
+            return i + __builtin_ctz(other);
     }
+#endif // __AVX2__ / __SSE2__
 
-    // Read next character
-    int c = scanner_getchar(s);
+    while (i < size && scanner_char_is(data[i], SCANNER_BLANK))
+        i++;
+    return i;
+}
 
-    // Skip spaces and check indendation
-    s->had_space_before = false;
-    while (isspace(c) && c != EOF)
+
+static void scanner_blanks(scanner_p s, srcpos_t pos)
+// ----------------------------------------------------------------------------
+//   Skip a run of blanks starting with the last character read
+// ----------------------------------------------------------------------------
+//   The whole run available in the input is processed at once. Only the
+//   indentation of the last line matters for the column, unless tabs and
+//   spaces may be mixed, in which case we check each character in order to
+//   emit the same diagnostics as a character-by-character scan.
+{
+    const char *run = s->input + s->input_next - 1;
+    size_t length = 1;
+    if (!s->pending)
+        length += scanner_blank_run(run + 1, s->input_length - s->input_next);
+
+    char indent = s->indent_char;
+    char other = indent == ' ' ? '\t' : ' ';
+    if (!indent || memchr(run, other, length))
     {
-        s->had_space_before = true;
-        if (c == '\n')
+        for (size_t i = 0; i < length; i++)
+        {
+            char c = run[i];
+            if (c == '\n')
+            {
+                // New line: start counting indentation
+                s->checking_indent = true;
+                s->column = 0;
+            }
+            else if (s->checking_indent)
+            {
+                // Can't mix tabs and spaces
+                if (c == ' ' || c == '\t')
+                {
+                    if (!s->indent_char)
+                        s->indent_char = c;
+                    else if (s->indent_char != c)
+                        error(pos, "Mixed tabs and spaces in indentation");
+                }
+                s->column++;
+            }
+        }
+    }
+    else
+    {
+        // Indentation uses a single character: only look at the last line
+        size_t last = length;
+        while (last > 0 && run[last-1] != '\n')
+            last--;
+        if (last)
         {
-            // New line: start counting indentation
             s->checking_indent = true;
-            s->column = 0;
+            s->column = length - last;
         }
         else if (s->checking_indent)
         {
-            // Can't mix tabs and spaces
-            if (c == ' ' || c == '\t')
-            {
-                if (!s->indent_char)
-                    s->indent_char = c;
-                else if (s->indent_char != c)
-                    error(pos, "Mixed tabs and spaces in indentation");
-            }
-            s->column++;
+            s->column += length;
         }
+    }
 
-        // Keep looking for more spaces
-        scanner_consume(s, c == '\n' ? c : 0);
-        c = scanner_getchar(s);
-    } // End of space processing (indentation check and space skipping)
+    // Consume the whole run, which is never part of a token spelling
+    position_advance(s->positions, length);
+    s->input_next += length - 1;
+    s->token_start = s->token_end = s->input_next;
+}
 
-    // Stop counting indentation
-    if (s->checking_indent)
+
+static inline bool scanner_accumulate(unsigned long long *value,
+                                      unsigned long long factor,
+                                      unsigned long long digits)
+// ----------------------------------------------------------------------------
+//   Compute value * factor + digits in place, return true on overflow
+// ----------------------------------------------------------------------------
+{
+#if defined(__GNUC__)
+    bool overflow = __builtin_mul_overflow(*value, factor, value);
+    return __builtin_add_overflow(*value, digits, value) || overflow;
+#else
+    bool overflow = *value > (ULLONG_MAX - digits) / factor;
+    *value = *value * factor + digits;
+    return overflow;
+#endif
+}
+
+
+static size_t scanner_decimal_run(const char *data, size_t size,
+                                  unsigned long long *value, bool *overflow)
+// ----------------------------------------------------------------------------
+//   Accumulate the decimal digits at the beginning of data, return count
+// ----------------------------------------------------------------------------
+//   Eight digits are checked and converted at a time in a 64-bit word.
+//   A byte is a digit if its high nibble is 3 both before and after adding 6.
+//   Digits are then combined pairwise into 2-digit, 4-digit and 8-digit
+//   values, the first character being in the lowest byte.
+{
+    size_t i = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= size; i += 8)
     {
-        scanner_ungetchar(s, c);
-        s->checking_indent = false;
+        uint64_t chunk;
+        memcpy(&chunk, data + i, sizeof(chunk));
+        uint64_t nibbles = (chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4);
+        if (nibbles != 0x3333333333333333ULL)
+            break;
+        chunk -= 0x3030303030303030ULL;
+        chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFULL;
+        chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFULL;
+        chunk = (chunk * 10000 + (chunk >> 32)) & 0x00000000FFFFFFFFULL;
+        *overflow |= scanner_accumulate(value, 100000000, chunk);
+    }
+#endif // __ORDER_LITTLE_ENDIAN__
 
-        if (s->setting_indent)
-        {
-            // We set a new indent, for instance after opening paren
-            indents_push(&s->indents, s->indent);
-            RECORD(SCANNER, "At pos %u return NEWLINE, indent %u -> %u",
-                   pos, s->indent, s->column);
-            s->indent = s->column;
-            s->setting_indent = false;
-            return tokNEWLINE;
-        }
-        else if (s->column > s->indent)
+    for (; i < size && scanner_char_is(data[i], SCANNER_DIGIT); i++)
+        *overflow |= scanner_accumulate(value, 10, data[i] - '0');
+    return i;
+}
+
+
+static int scanner_decimal(scanner_p s, int c,
+                           unsigned long long *value, bool *overflow)
+// ----------------------------------------------------------------------------
+//   Scan the decimal digits available in the input, return next character
+// ----------------------------------------------------------------------------
+//   The digits are consumed directly from the input buffer. We stop before
+//   the last digit if a '_' follows, so that the general loop checks it.
+{
+    if (s->pending)
+        return c;
+
+    const char *digits = s->input + s->input_next - 1;
+    size_t available = s->input_length - s->input_next + 1;
+    size_t length = scanner_decimal_run(digits, available, value, overflow);
+    if (length < available && digits[length] == '_')
+    {
+        *value = 0;
+        *overflow = false;
+        length = scanner_decimal_run(digits, length - 1, value, overflow);
+    }
+    if (!length)
+        return c;
+
+    position_advance(s->positions, length);
+    s->input_next += length - 1;
+    s->token_end = s->input_next;
+    return scanner_getchar(s);
+}
+
+
+static double scanner_decimal_real(const char *data, size_t length)
+// ----------------------------------------------------------------------------
+//   Convert the spelling of a decimal real number to a correctly rounded value
+// ----------------------------------------------------------------------------
+//   The first 19 significant digits are accumulated in an integer mantissa.
+//   If it fits in the 53 bits of a double and the decimal exponent is small
+//   enough for the power of 10 to be exact, a single multiplication or
+//   division is correctly rounded (Clinger's fast path). Other cases, which
+//   are rare in practice, are left to strtod.
+{
+    static const double powers[] =
+    {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const int max_power = sizeof(powers) / sizeof(powers[0]) - 1;
+    const uint64_t max_mantissa = 1ULL << 53;
+
+    uint64_t mantissa = 0;
+    unsigned digits = 0;
+    int exponent = 0;
+    bool fraction = false;
+    bool truncated = false;
+    size_t i = 0;
+    for (; i < length; i++)
+    {
+        char c = data[i];
+        if (c == '.')
         {
-            // Strictly deeper indent : report
-            RECORD(SCANNER, "At pos %u return INDENT, indent %u -> %u",
-                   pos, s->indent, s->column);
-            s->indent = s->column;
-            indents_push(&s->indents, s->indent);
-            return tokINDENT;
+            fraction = true;
         }
-        else if (s->column < indents_top(s->indents))
+        else if (scanner_char_is(c, SCANNER_DIGIT))
         {
-            // Unindenting: remove rightmost indent level
-            indents_pop(&s->indents);
-            RECORD(SCANNER, "At pos %u return UNINDENT, indent %u -> %u",
-                   pos, s->indent, s->column);
-            s->indent = s->column;
-
-            // If we unindented, but did not go as far as the
-            // most recent indent, report inconsistency.
-            if (indents_length(s->indents) &&
-                indents_top(s->indents) < s->column)
+            if (digits < 19)
             {
-                error(pos, "Unindenting to the right of previous indentation");
-                return tokERROR;
+                mantissa = 10 * mantissa + (c - '0');
+                digits += mantissa != 0;
+                exponent -= fraction;
+            }
+            else
+            {
+                exponent += !fraction;
+                truncated |= c != '0';
             }
-
-            // Otherwise, report that we unindented
-            // We may report multiple tokUNINDENT if we unindented deep
-            return tokUNINDENT;
         }
-        else
+        else if (c != '_')
         {
-            // Exactly the same indent level as before
-            RECORD(SCANNER, "At pos %u return NEWLINE, same indent", pos);
-            return tokNEWLINE;
+            break;
         }
     }
 
-    // Report end of input if that's what we've got at that stage
-    if (!s->reader)
+    // Exponent, saturated well beyond the range of double
+    if (i < length && (data[i] == 'e' || data[i] == 'E'))
     {
-        RECORD(SCANNER, "At pos %u return EOF after spaces", pos);
-	return tokEOF;
+        int sign = 1;
+        int value = 0;
+        if (++i < length && (data[i] == '+' || data[i] == '-'))
+            sign = data[i++] == '-' ? -1 : 1;
+        for (; i < length; i++)
+            if (scanner_char_is(data[i], SCANNER_DIGIT) &&
+                value < SCANNER_MAX_EXPONENT)
+                value = 10 * value + (data[i] - '0');
+        exponent += sign * value;
     }
 
-    // Clear spelling from whitespaces
-    text_range(&s->source, 0, 0);
-
-    // Update position to match first non-space
-    pos = scanner_position(s);
+    if (mantissa == 0)
+        return 0.0;
 
-    // Check if we have a blob
-    blob_p blob = NULL;
-    if (c == '$')
+#if FLT_EVAL_METHOD == 0
+    if (!truncated && mantissa <= max_mantissa)
     {
-        c = scanner_nextchar(s, c);
-        blob_set(&blob, blob_new(pos, 0, NULL));
+        // Move excess powers of 10 into the mantissa while it remains exact
+        while (exponent > max_power && mantissa <= max_mantissa / 10)
+        {
+            mantissa *= 10;
+            exponent--;
+        }
+        if (exponent >= 0 && exponent <= max_power)
+            return (double) mantissa * powers[exponent];
+        if (exponent < 0 && exponent >= -max_power)
+            return (double) mantissa / powers[-exponent];
     }
+#endif // FLT_EVAL_METHOD
+
+    // Slow path: let the C library do the rounding, without the '_'
+    char local[64];
+    char *buffer = length < sizeof(local) ? local : malloc(length + 1);
+    size_t size = 0;
+    for (i = 0; i < length; i++)
+        if (data[i] != '_')
+            buffer[size++] = data[i];
+    buffer[size] = 0;
+    double result = strtod(buffer, NULL);
+    if (buffer != local)
+        free(buffer);
+    return result;
+}
 
-    // Look for numbers
-    if (blob || isdigit(c))
-    {
-        unsigned           base           = 10;
-        unsigned           blob_base      = 16;
-        unsigned long long natural_value  = 0;
-        bool               floating_point = false;
-        bool               based_number   = false;
-        uint32_t           blob_chunk     = 0;
+
+#ifdef __SSE2__
+static inline __m128i scanner_in_range(__m128i bytes, char low, char high)
+// ----------------------------------------------------------------------------
+//   Return a mask of the bytes between low and high, all in ASCII range
+// ----------------------------------------------------------------------------
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(low - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), bytes));
+}
+
+
+static unsigned scanner_hex16(const char *data, char *output)
+// ----------------------------------------------------------------------------
+//   Decode 16 hexadecimal digits into 8 bytes, return mask of valid digits
+// ----------------------------------------------------------------------------
+//   Letters are checked after folding to lowercase. Each pair of digit
+//   values is merged in a 16-bit lane, and lanes are then packed as bytes.
+//   Nothing is written unless all digits are valid, or if output is NULL.
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *) data);
+    __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    __m128i digit = scanner_in_range(bytes, '0', '9');
+    __m128i alpha = scanner_in_range(lower, 'a', 'f');
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(digit, alpha));
+    if (mask == 0xFFFF && output)
+    {
+        __m128i value = _mm_sub_epi8(
+            _mm_sub_epi8(lower, _mm_set1_epi8('0')),
+            _mm_and_si128(alpha, _mm_set1_epi8('a' - '0' - 10)));
+        __m128i pairs = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0xFF)), 4),
+            _mm_srli_epi16(value, 8));
+        _mm_storel_epi64((__m128i *) output, _mm_packus_epi16(pairs, pairs));
+    }
+    return mask;
+}
+
+
+static unsigned scanner_base64_16(const char *data, char *output)
+// ----------------------------------------------------------------------------
+//   Decode 16 base-64 digits into 12 bytes, return mask of valid digits
+// ----------------------------------------------------------------------------
+//   Each class of characters gets its own offset to the digit value.
+//   Digit values are then merged by pairs in 16-bit lanes, and pairs
+//   in 32-bit lanes, each holding the 24 bits of 3 output bytes.
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *) data);
+    __m128i upper = scanner_in_range(bytes, 'A', 'Z');
+    __m128i lower = scanner_in_range(bytes, 'a', 'z');
+    __m128i digit = scanner_in_range(bytes, '0', '9');
+    __m128i plus = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('+'));
+    __m128i slash = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('/'));
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                 _mm_or_si128(digit,
+                                              _mm_or_si128(plus, slash)));
+    unsigned mask = _mm_movemask_epi8(valid);
+    if (mask == 0xFFFF && output)
+    {
+        __m128i offset = _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(0 - 'A')),
+                         _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+            _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                         _mm_or_si128(
+                             _mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+                             _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+        __m128i value = _mm_add_epi8(bytes, offset);
+        __m128i pairs = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(value, _mm_set1_epi16(0xFF)), 6),
+            _mm_srli_epi16(value, 8));
+        __m128i quads = _mm_or_si128(
+            _mm_slli_epi32(_mm_and_si128(pairs, _mm_set1_epi32(0xFFFF)), 12),
+            _mm_srli_epi32(pairs, 16));
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *) lanes, quads);
+        for (unsigned i = 0; i < 4; i++)
+        {
+            *output++ = (char) (lanes[i] >> 16);
+            *output++ = (char) (lanes[i] >> 8);
+            *output++ = (char) lanes[i];
+        }
+    }
+    return mask;
+}
+#endif // __SSE2__
+
+
+static size_t scanner_blob_run(const char *data, size_t size,
+                               const uint8_t *digit_value, unsigned base)
+// ----------------------------------------------------------------------------
+//   Return the number of blob digits at the beginning of data
+// ----------------------------------------------------------------------------
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (base == 16 || base == 64)
+    {
+        for (; i + 16 <= size; i += 16)
+        {
+            unsigned mask = base == 16
+                ? scanner_hex16(data + i, NULL)
+                : scanner_base64_16(data + i, NULL);
+            if (mask != 0xFFFF)
+                return i + __builtin_ctz(~mask);
+        }
+    }
+#endif // __SSE2__
+
+    while (i < size && digit_value[(uint8_t) data[i]] < base)
+        i++;
+    return i;
+}
+
+
+static size_t scanner_blob_extent(const char *data, size_t size,
+                                  const uint8_t *digit_value, unsigned base,
+                                  size_t *digits, unsigned long long *natural)
+// ----------------------------------------------------------------------------
+//   Find the blob digits, single '_' and blanks that can be decoded in bulk
+// ----------------------------------------------------------------------------
+//   We stop before the last digit, so that the general loop checks what
+//   follows it and refills the input if necessary. Before the '#' of a
+//   base, natural receives the decimal value of the digits, like for numbers.
+{
+    unsigned long long value = natural ? *natural : 0;
+    unsigned long long before = value;
+    size_t length = 0;
+    size_t count = 0;
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t run = 0;
+        if (natural)
+        {
+            uint8_t digit;
+            while (i + run < size &&
+                   (digit = digit_value[(uint8_t) data[i + run]]) < base)
+            {
+                before = value;
+                value = 10 * value + digit;
+                run++;
+            }
+        }
+        else
+        {
+            run = scanner_blob_run(data + i, size - i, digit_value, base);
+        }
+        if (!run)
+            break;
+        count += run;
+        i += run;
+        length = i - 1;
+        if (i < size && data[i] == '_')
+            if (++i < size && data[i] == '_')
+                break;
+        while (i < size && scanner_char_is(data[i], SCANNER_BLANK))
+            i++;
+    }
+    if (natural)
+        *natural = before;
+    *digits = count ? count - 1 : 0;
+    return length;
+}
+
+
+static void scanner_blob_decode(const char *data, size_t length,
+                                const uint8_t *digit_value, unsigned base,
+                                unsigned digbits, unsigned maxbits,
+                                uint32_t *chunk, unsigned *bits, char *output)
+// ----------------------------------------------------------------------------
+//   Decode blob digits into a buffer sized by scanner_blob_extent
+// ----------------------------------------------------------------------------
+//   Characters that are not digits are '_' or blanks, and are skipped.
+//   Hexadecimal and base-64 digits are decoded 16 at a time when the
+//   pending chunk is empty, others are accumulated in the chunk.
+{
+    uint32_t value = *chunk;
+    unsigned count = *bits;
+    size_t i = 0;
+    while (i < length)
+    {
+#ifdef __SSE2__
+        if (count == 0 && i + 16 <= length)
+        {
+            if (base == 16 && scanner_hex16(data + i, output) == 0xFFFF)
+            {
+                i += 16;
+                output += 8;
+                continue;
+            }
+            if (base == 64 && scanner_base64_16(data + i, output) == 0xFFFF)
+            {
+                i += 16;
+                output += 12;
+                continue;
+            }
+        }
+#endif // __SSE2__
+
+        uint8_t digit = digit_value[(uint8_t) data[i++]];
+        if (digit >= base)
+            continue;
+        value = (value << digbits) | digit;
+        count += digbits;
+        if (count >= maxbits)
+        {
+            if (maxbits == 24)
+            {
+                *output++ = (char) (value >> 16);
+                *output++ = (char) (value >> 8);
+            }
+            *output++ = (char) value;
+            count = 0;
+        }
+    }
+    *chunk = value;
+    *bits = count;
+}
+
+
+static token_t scanner_indentation(scanner_p s, srcpos_t pos)
+// ----------------------------------------------------------------------------
+//   Return the token for the indentation of a new line at current column
+// ----------------------------------------------------------------------------
+{
+    if (s->setting_indent)
+    {
+        // We set a new indent, for instance after opening paren
+        indents_push(&s->indents, s->indent);
+        RECORD(SCANNER, "At pos %u return NEWLINE, indent %u -> %u",
+               pos, s->indent, s->column);
+        s->indent = s->column;
+        s->setting_indent = false;
+        return tokNEWLINE;
+    }
+    else if (s->column > s->indent)
+    {
+        // Strictly deeper indent : report
+        RECORD(SCANNER, "At pos %u return INDENT, indent %u -> %u",
+               pos, s->indent, s->column);
+        s->indent = s->column;
+        indents_push(&s->indents, s->indent);
+        return tokINDENT;
+    }
+    else if (s->column < indents_top(s->indents))
+    {
+        // Unindenting: remove rightmost indent level
+        indents_pop(&s->indents);
+        RECORD(SCANNER, "At pos %u return UNINDENT, indent %u -> %u",
+               pos, s->indent, s->column);
+        s->indent = s->column;
+
+        // If we unindented, but did not go as far as the
+        // most recent indent, report inconsistency.
+        if (indents_length(s->indents) &&
+            indents_top(s->indents) < s->column)
+        {
+            error(pos, "Unindenting to the right of previous indentation");
+            return tokERROR;
+        }
+
+        // Otherwise, report that we unindented
+        // We may report multiple tokUNINDENT if we unindented deep
+        return tokUNINDENT;
+    }
+
+    // Exactly the same indent level as before
+    RECORD(SCANNER, "At pos %u return NEWLINE, same indent", pos);
+    return tokNEWLINE;
+}
+
+
+static token_t scanner_token(scanner_p s)
+// ----------------------------------------------------------------------------
+//    Scan input and return current token
+// ----------------------------------------------------------------------------
+{
+    srcpos_t pos = scanner_position(s);
+
+    // Start a new token spelling and clear scanned tree if it was set earlier
+    scanner_spelling(s, pos);
+    tree_dispose(&s->scanned.tree);
+
+    // Check if we have something to read
+    if (!s->reader && !s->pushed)
+    {
+        RECORD(SCANNER, "At pos %u return EOF", pos);
+        return tokEOF;
+    }
+
+    // Check if we unindented far enough for multiple indents
+    s->had_space_before = true;
+    if (indents_length(s->indents) > 0 && indents_top(s->indents) > s->indent)
+    {
+        RECORD(SCANNER, "At pos %u return UNINDENT, indent %u > %u",
+               pos, indents_top(s->indents), s->indent);
+        indents_pop(&s->indents);
+        return tokUNINDENT;
+    }
+
+    // Read next character
+    int c = scanner_getchar(s);
+
+    // Skip spaces and check indendation
+    s->had_space_before = false;
+    while (scanner_char_is(c, SCANNER_BLANK))
+    {
+        s->had_space_before = true;
+        scanner_blanks(s, pos);
+        c = scanner_getchar(s);
+    } // End of space processing (indentation check and space skipping)
+
+    // Indentation can only be decided once we have the following character
+    if (s->starved)
+        return tokNONE;
+
+    // Stop counting indentation
+    if (s->checking_indent)
+    {
+        scanner_ungetchar(s, c);
+        s->checking_indent = false;
+        if (s->raw_indent)
+        {
+            RECORD(SCANNER, "At pos %u return line start, column %u",
+                   pos, s->column);
+            return tokNEWLINE;
+        }
+        return scanner_indentation(s, pos);
+    }
+
+    // Report end of input if that's what we've got at that stage
+    if (!s->reader && !s->pushed)
+    {
+        RECORD(SCANNER, "At pos %u return EOF after spaces", pos);
+	return tokEOF;
+    }
+
+    // Clear spelling from whitespaces
+    s->token_start = s->token_end;
+
+    // Update position to match first non-space
+    pos = scanner_position(s);
+    s->token_position = pos;
+
+    // Check if we have a blob
+    blob_p blob = NULL;
+    if (c == '$')
+    {
+        c = scanner_nextchar(s);
+        blob_set(&blob, blob_new(pos, 0, NULL));
+    }
+
+    // Look for numbers
+    if (blob || scanner_char_is(c, SCANNER_DIGIT))
+    {
+        unsigned           base           = 10;
+        unsigned           blob_base      = 16;
+        unsigned long long natural_value  = 0;
+        bool               overflow       = false;
+        bool               floating_point = false;
+        bool               huge_exponent  = false;
+        bool               based_number   = false;
+        bool               decimal        = true;
+        uint32_t           blob_chunk     = 0;
         unsigned           blob_bits      = 0;
         unsigned           blob_digbits   = 4;
         unsigned           blob_maxbits   = 8;
 
-        // Initialize digit values the first time
-        static uint8_t base_value[0x100] = { 0 };
-        static uint8_t base64_value[0x100] = { 0 };
-        if (base_value[0] == 0)
-        {
-            // For bases 2-36
-            for (unsigned i = 0; i < 0x100; i++)
-                base_value[i] = 0xFF;
-            for (unsigned i = '0'; i <= '9'; i++)
-                base_value[i] = i - '0';
-            for (unsigned i = 'A'; i <= 'Z'; i++)
-                base_value[i] = i - 'A' + 10;
-            for (unsigned i = 'a'; i <= 'z'; i++)
-                base_value[i] = i - 'a' + 10;
-
-            // For base-64 (see https://en.wikipedia.org/wiki/Base64)
-            for (unsigned i = 0; i < 0x100; i++)
-                base64_value[i] = 0xFF;
-            for (unsigned i = 'A'; i <= 'Z'; i++)
-                base64_value[i] = i - 'A';
-            for (unsigned i = 'a'; i <= 'z'; i++)
-                base64_value[i] = i - 'a' + 26;
-            for (unsigned i = '0'; i <= '9'; i++)
-                base64_value[i] = i - '0' + 52;
-            base64_value['+'] = 62;
-            base64_value['/'] = 63;
-        }
-
-        uint8_t *digit_value = base_value;
+        const uint8_t *digit_value = scanner_digit_values;
+
+        // Fast path for the decimal digits available in the input buffer
+        if (!blob)
+            c = scanner_decimal(s, c, &natural_value, &overflow);
 
         // Take integral part (or base)
         do
         {
-            while (digit_value[c] < base ||
-                   (blob && digit_value[c] < blob_base))
+            uint8_t digit;
+            while ((digit = digit_value[(uint8_t) c]) < base ||
+                   (blob && digit < blob_base))
             {
-                natural_value = base * natural_value + digit_value[c];
+                if (blob && !s->pending)
+                {
+                    // Decode runs of blob digits directly from the input
+                    const char *data = s->input + s->input_next - 1;
+                    size_t available = s->input_length - s->input_next + 1;
+                    size_t digits = 0;
+                    size_t length = scanner_blob_extent(
+                        data, available, digit_value, blob_base, &digits,
+                        based_number ? NULL : &natural_value);
+                    if (length)
+                    {
+                        size_t old_length = blob_length(blob);
+                        size_t bits = blob_bits + digits * blob_digbits;
+                        size_t bytes = bits / blob_maxbits * blob_maxbits / 8;
+                        blob_append_data(&blob, bytes, NULL);
+                        if (tree_budget_exceeded())
+                        {
+                            blob_dispose(&blob);
+                            return tokERROR;
+                        }
+                        scanner_blob_decode(data, length,
+                                            digit_value, blob_base,
+                                            blob_digbits, blob_maxbits,
+                                            &blob_chunk, &blob_bits,
+                                            blob_data(blob) + old_length);
+                        position_advance(s->positions, length);
+                        s->input_next += length - 1;
+                        s->token_end = s->input_next;
+                        c = scanner_getchar(s);
+                        digit = digit_value[(uint8_t) c];
+                    }
+                }
+
+                overflow |= scanner_accumulate(&natural_value, base, digit);
                 if (blob)
                 {
                     // Record blob digits as we go
-                    blob_chunk = (blob_chunk << blob_digbits) | digit_value[c];
+                    blob_chunk = (blob_chunk << blob_digbits) | digit;
                     blob_bits += blob_digbits;
                     if (blob_bits >= blob_maxbits)
                     {
@@ -483,21 +1419,26 @@ token_t scanner_read(scanner_p s)
                                                    (char) blob_chunk };
                             blob_append_data(&blob, 3, blob_bytes);
                         }
+                        blob_bits = 0;
+                        if (tree_budget_exceeded())
+                        {
+                            blob_dispose(&blob);
+                            return tokERROR;
+                        }
                     }
-
                 }
-                c = scanner_nextchar(s, c);
+                c = scanner_nextchar(s);
                 if (c == '_')       // Skip a single underscore
                 {
-                    c = scanner_nextchar(s, c);
+                    c = scanner_nextchar(s);
                     if (c == '_')
                         error(pos, "Two '_' characters in a row look ugly");
                 }
                 if (blob)
                 {
                     // Skip whitespace in blobs
-                    while (c != EOF && isspace(c))
-                        c = scanner_nextchar(s, 0);
+                    while (scanner_char_is(c, SCANNER_BLANK))
+                        c = scanner_nextchar(s);
                 }
 
             }
@@ -506,17 +1447,18 @@ token_t scanner_read(scanner_p s)
             if (c == '#' && !based_number)
             {
                 base = blob_base = natural_value;
-                if (base == 64)
+                bool valid_base = base == 64 || (base >= 2 && base <= 36);
+                if (!valid_base)
                 {
-                    // Special case for base-64: switch coding table
-                    digit_value = base64_value;
+                    error(pos, "The base %d is not valid, not in 2..36", base);
+                    base = 36;
                 }
-                else if (base < 2 || base > 36)
+                else if (base == 64)
                 {
-                    base = 36;
-                    error(pos, "The base %d is not valid, not in 2..36", base);
+                    // Special case for base-64: switch coding table
+                    digit_value = scanner_base64_values;
                 }
-                else if (blob)
+                if (valid_base && blob)
                 {
                     // Remove any byte we may have recorded in the blob
                     blob_range(&blob, 0, 0);
@@ -535,9 +1477,11 @@ token_t scanner_read(scanner_p s)
                         error(pos, "Base %d is invalid for a blob", base);
                     }
                 }
-                c = scanner_nextchar(s, c);
+                c = scanner_nextchar(s);
                 natural_value = 0;
+                overflow = false;
                 based_number = true;
+                decimal = false;
             }
             else
             {
@@ -551,11 +1495,11 @@ token_t scanner_read(scanner_p s)
         {
             // Check = terminator in base64
             if (blob_base == 64 && c == '=')
-                c = scanner_nextchar(s, c);
+                c = scanner_nextchar(s);
 
             // Check if there is a $ at end of blob
             if (c == '$')
-                scanner_consume(s, c);
+                scanner_consume(s);
             else
                 scanner_ungetchar(s, c);
 
@@ -583,24 +1527,29 @@ token_t scanner_read(scanner_p s)
                 }
             }
             blob_set(&s->scanned.blob, (blob_p) blob);
-            RECORD(SCANNER, "At pos %u return BLOB %p", pos, blob);
+            blob_dispose(&blob);
+            RECORD(SCANNER, "At pos %u return BLOB %p", pos, s->scanned.blob);
             return tokBLOB;
         }
 
         // Check for fractional part for real numbers
         else if (c == '.')
         {
-            int mantissa_digit = scanner_nextchar(s, c);
-            if (digit_value[mantissa_digit] >= base)
+            int mantissa_digit = scanner_nextchar(s);
+            if (digit_value[(uint8_t) mantissa_digit] >= base)
             {
                 // This is something else following an integer: 1..3, 1.(3)
-                natural_p n = natural_new(pos, natural_value);
-                scanner_ungetchar(s, mantissa_digit);
+                c = scanner_backtrack(s, scanner_token_length(s) - 1);
                 scanner_ungetchar(s, c);
+                if (overflow)
+                {
+                    error(pos, "Integer %t is too large", scanner_source(s));
+                    natural_value = ULLONG_MAX;
+                }
                 s->had_space_after = false;
-                natural_set(&s->scanned.natural, n);
-                RECORD(SCANNER, "At pos %u return INTEGER %p after %c%c",
-                       pos, n, c, mantissa_digit);
+                scanner_natural(s, pos, natural_value);
+                RECORD(SCANNER, "At pos %u return INTEGER %llu after %c%c",
+                       pos, natural_value, c, mantissa_digit);
                 return tokINTEGER;
             }
             else
@@ -608,14 +1557,17 @@ token_t scanner_read(scanner_p s)
                 double comma_position = 1.0;
                 floating_point = true;
                 c = mantissa_digit;
-                while (digit_value[c] < base)
+                while (digit_value[(uint8_t) c] < base)
                 {
-                    comma_position /= base;
-                    real_value += comma_position * digit_value[c];
-                    c = scanner_nextchar(s, c);
+                    if (!decimal)
+                    {
+                        comma_position /= base;
+                        real_value += comma_position*digit_value[(uint8_t) c];
+                    }
+                    c = scanner_nextchar(s);
                     if (c == '_')
                     {
-                        c = scanner_nextchar(s, c);
+                        c = scanner_nextchar(s);
                         if (c == '_')
                             error(pos, "Two _ characters look really ugly");
                     }
@@ -625,12 +1577,12 @@ token_t scanner_read(scanner_p s)
 
         // Check if we have a second '#' at end of based number (16#FF#e3)
         if (c == '#')
-            c = scanner_nextchar(s, c);
+            c = scanner_nextchar(s);
 
         // Check for the exponent
         if (c == 'e' || c == 'E')
         {
-            c = scanner_nextchar(s, c);
+            c = scanner_nextchar(s);
 
             unsigned exponent = 0;
             bool negative_exponent = false;
@@ -638,26 +1590,32 @@ token_t scanner_read(scanner_p s)
             // Exponent sign
             if (c == '+')
             {
-                c = scanner_nextchar(s, c);
+                c = scanner_nextchar(s);
             }
             else if (c == '-')
             {
-                c = scanner_nextchar(s, c);
+                c = scanner_nextchar(s);
                 negative_exponent = true;
                 floating_point = true;
             }
 
-            // Exponent value (always in base 10)
-            while (base_value[c] < 10)
+            // Exponent value (always in base 10), saturated well beyond
+            // the range of any number, so that it cannot wrap around
+            while (scanner_digit_values[(uint8_t) c] < 10)
             {
-                exponent = 10 * exponent + base_value[c];
-                c = scanner_nextchar(s, c);
+                exponent = 10 * exponent + scanner_digit_values[(uint8_t) c];
+                if (exponent > SCANNER_MAX_EXPONENT)
+                {
+                    exponent = SCANNER_MAX_EXPONENT;
+                    huge_exponent = true;
+                }
+                c = scanner_nextchar(s);
                 if (c == '_')
-                    c = scanner_nextchar(s, c);
+                    c = scanner_nextchar(s);
             }
 
-            // Compute base^exponent
-            if (floating_point)
+            // Compute base^exponent, decimal reals are converted at the end
+            if (floating_point && !decimal)
             {
                 double exponent_value = 1.0;
                 double multiplier = base;
@@ -675,45 +1633,60 @@ token_t scanner_read(scanner_p s)
                 else
                     real_value *= exponent_value;
             }
-            else
+            else if (!floating_point)
             {
                 unsigned long long exponent_value = 1;
                 unsigned long long multiplier = base;
                 while (exponent)
                 {
                     if (exponent & 1)
-                        exponent_value *= multiplier;
+                        overflow |= scanner_accumulate(&exponent_value,
+                                                       multiplier, 0);
                     exponent >>= 1;
-                    multiplier *= multiplier;
+                    if (exponent)
+                        overflow |= scanner_accumulate(&multiplier,
+                                                       multiplier, 0);
                 }
-                natural_value *= exponent_value;
+                overflow |= scanner_accumulate(&natural_value,
+                                               exponent_value, 0);
             }
         }
 
         // Return the token
         scanner_ungetchar(s, c);
-        s->had_space_after = isspace(c);
+        s->had_space_after = scanner_char_is(c, SCANNER_BLANK);
         if (floating_point)
         {
-            real_set(&s->scanned.real, real_new(pos, real_value));
-            RECORD(SCANNER, "At pos %u return REAL %p", pos, s->scanned.real);
+            if (huge_exponent)
+                error(pos, "Exponent of real %t is too large",
+                      scanner_source(s));
+            if (decimal)
+                real_value = scanner_decimal_real(scanner_token_data(s),
+                                                  scanner_token_length(s));
+            scanner_real(s, pos, real_value);
+            RECORD(SCANNER, "At pos %u return REAL %g", pos, real_value);
             return tokREAL;
         }
-        natural_set(&s->scanned.natural, natural_new(pos, natural_value));
-        RECORD(SCANNER, "At pos %u return INTEGER %p", pos, s->scanned.natural);
+        if (overflow || huge_exponent)
+        {
+            error(pos, "Integer %t is too large", scanner_source(s));
+            natural_value = ULLONG_MAX;
+        }
+        scanner_natural(s, pos, natural_value);
+        RECORD(SCANNER, "At pos %u return INTEGER %llu", pos, natural_value);
         return tokINTEGER;
     } // End of numbers
 
     // Look for names
-    else if (utf8_isalpha(c))
+    else if (scanner_char_is(c, SCANNER_NAME_FIRST))
     {
-        while (isalnum(c) || c == '_' || utf8_is_first(c) || utf8_is_next(c))
-            c = scanner_nextchar(s, c);
+        while (scanner_char_is(c, SCANNER_NAME_NEXT))
+            c = scanner_nextchar(s);
         scanner_ungetchar(s, c);
-        s->had_space_after = isspace(c);
+        s->had_space_after = scanner_char_is(c, SCANNER_BLANK);
 
         // Check if this is a block marker
-        name_set(&s->scanned.name, scanner_normalize(s->source));
+        name_set(&s->scanned.name, scanner_normalize(s));
         if (s->syntax)
         {
             if (syntax_is_block(s->syntax, s->scanned.name, &s->block_close))
@@ -740,8 +1713,8 @@ token_t scanner_read(scanner_p s)
     else if (c == '"' || c == '\'')
     {
         char eos = c;
-        text_p text = text_use(text_new(pos, 0, NULL));
-        c = scanner_nextchar(s, c);
+        bool terminated = true;
+        c = scanner_nextchar(s);
         for(;;)
         {
             // Check end of text
@@ -749,15 +1722,18 @@ token_t scanner_read(scanner_p s)
             {
                 error(pos, "End of input in the middle of a text");
                 s->had_space_after = false;
+                terminated = false;
                 c = eos;
             }
             if (c == eos)
             {
-                c = scanner_nextchar(s, c);
+                c = scanner_nextchar(s);
                 if (c != eos)
                 {
                     scanner_ungetchar(s, c);
-                    s->had_space_after = isspace(c);
+                    s->had_space_after = scanner_char_is(c, SCANNER_BLANK);
+                    text_p text = text_use(scanner_text(s, pos, eos,
+                                                        terminated));
                     if (eos == '"')
                     {
                         text_set(&s->scanned.text, text);
@@ -765,19 +1741,21 @@ token_t scanner_read(scanner_p s)
                         text_dispose(&text);
                         return tokTEXT;
                     }
-                    character_set(&s->scanned.character,
-                                  scanner_character(text));
+                    unsigned code = scanner_character(text);
+                    if (s->packed)
+                        s->value.natural = code;
+                    else
+                        character_set(&s->scanned.character,
+                                      character_new(pos, code));
                     text_dispose(&text);
-                    RECORD(SCANNER, "At pos %u return CHARACTER %p",
-                           pos, s->scanned.character);
+                    RECORD(SCANNER, "At pos %u return CHARACTER %u",
+                           pos, code);
                     return tokCHARACTER;
                 }
 
                 // Doubling the quoting character puts it in the text
             }
-            char ch = (char) c;
-            text_append_data(&text, 1, &ch);
-            c = scanner_nextchar(s, c);
+            c = scanner_nextchar(s);
         }
     } // End of text handling
 
@@ -785,36 +1763,60 @@ token_t scanner_read(scanner_p s)
     token_t tok = tokSYMBOL;
     if (s->syntax)
     {
-        // Normal scanning mode: check if operators exist in syntax
-        while (ispunct(c) && c != '\'' && c != '"' && c != EOF &&
-               syntax_is_operator(s->syntax, (name_p) s->source))
+        // Normal scanning mode: find the longest operator in the syntax
+        syntax_p syntax = s->syntax;
+        unsigned state = SYNTAX_OPERATOR_START;
+        size_t length = 0;
+        size_t longest = 0;
+        while (scanner_char_is(c, SCANNER_SYMBOL) &&
+               (state = syntax_operator_next(syntax, state, c)))
         {
-            c = scanner_nextchar(s, c);
-            name_p name = (name_p) s->source;
-            if (syntax_is_block(s->syntax, name, &s->block_close))
+            c = scanner_nextchar(s);
+            length++;
+            name_p known = syntax_operator_name(syntax, state);
+            if (!known)
+                continue;
+            longest = length;
+
+            name_p closing = syntax_operator_closing(syntax, state);
+            if (closing)
             {
+                name_set(&s->block_close, closing);
                 tok = tokOPEN;
                 break;
             }
             else if (s->block_close &&
-                     name_compare(name, s->block_close) == 0)
+                     name_compare(known, s->block_close) == 0)
             {
                 name_dispose(&s->block_close);
                 tok = tokCLOSE;
                 break;
             }
         }
+
+        // Unknown symbols are a single character
+        if (!longest)
+        {
+            if (length)
+                c = scanner_backtrack(s, 1);
+            else if (scanner_char_is(c, SCANNER_SYMBOL))
+                c = scanner_nextchar(s);
+        }
+        else if (longest < length)
+        {
+            c = scanner_backtrack(s, longest);
+        }
     }
     else
     {
         // Syntax discovery mode: accept any operator
-        while (ispunct(c) && c != '\'' && c != '"' && c != EOF)
-            c = scanner_nextchar(s, c);
+        while (scanner_char_is(c, SCANNER_SYMBOL))
+            c = scanner_nextchar(s);
     }
 
     scanner_ungetchar(s, c);
-    s->had_space_after = isspace(c);
-    name_set(&s->scanned.name, scanner_normalize(s->source));
+    s->had_space_after = scanner_char_is(c, SCANNER_BLANK);
+    name_set(&s->scanned.name, scanner_normalize(s));
     RECORD(SCANNER, "At pos %u return %s %p",
            pos,
            tok == tokOPEN ? "OPEN" : tok == tokCLOSE ? "CLOSE" : "SYMBOL",
@@ -823,81 +1825,276 @@ token_t scanner_read(scanner_p s)
 }
 
 
-text_p scanner_skip(scanner_p s, name_p closing)
+static inline bool scanner_resumable(char first)
 // ----------------------------------------------------------------------------
-//    Read ahead until we find the closing marker (for comments or long text)
+//   Check if a token beginning with first can be long: texts, names, numbers
 // ----------------------------------------------------------------------------
 {
-    const char *eoc      = name_data(closing);
-    const char *match    = eoc;
-    unsigned    position = scanner_position(s);
-    text_p      comment  = text_new(position, 0, NULL);
-    int         c        = 0;
-    bool        skip     = false;
+    return first == '"' || first == '\'' ||
+        scanner_char_is(first, SCANNER_NAME_FIRST) ||
+        scanner_char_is(first, SCANNER_DIGIT);
+}
 
-    // Clear source and scanned value if any
-    text_set(&s->source, text_new(position, 0, NULL));
-    text_dispose(&s->scanned.text);
 
-    while (*match && c != EOF)
-    {
-        c = scanner_nextchar(s, c);
-        skip = false;
+static bool scanner_may_end(char first, char c)
+// ----------------------------------------------------------------------------
+//   Check if a character may end a resumable token that begins with first
+// ----------------------------------------------------------------------------
+{
+    if (first == '"' || first == '\'')
+        return c == first;
+    if (scanner_char_is(first, SCANNER_NAME_FIRST))
+        return !scanner_char_is(c, SCANNER_NAME_NEXT);
+    return !scanner_char_is(c, SCANNER_DIGIT) && c != '_';
+}
 
-        if (c == '\n')
+
+token_t scanner_read(scanner_p s)
+// ----------------------------------------------------------------------------
+//    Scan input and return current token
+// ----------------------------------------------------------------------------
+//    With pushed input, running out of input within a token restores the
+//    state from before the token, including errors, and returns tokNONE.
+//    The input scanned so far is remembered, and the token is only scanned
+//    again once the input fed after it may end it, so that feeding a long
+//    token in small pieces does not rescan it each time.
+{
+    if (!s->pushed)
+        return scanner_token(s);
+
+    if (s->resume && !s->finished)
+    {
+        size_t resume = s->resume;
+        while (resume < s->input_length &&
+               !scanner_may_end(s->resume_first, s->input[resume]))
+            resume++;
+        if (resume == s->input_length)
         {
-            // New line: start counting indentation
-            s->checking_indent = true;
-            s->column = 0;
+            RECORD(SCANNER, "Starved within token, resume at %zu", resume);
+            s->resume = resume;
+            s->starved = true;
+            return tokNONE;
         }
-        else if (s->checking_indent)
+    }
+    s->resume = 0;
+
+    srcpos_t consumed         = position(s->positions);
+    size_t   input_next       = s->input_next;
+    unsigned pending          = s->pending;
+    size_t   token_end        = s->token_end;
+    unsigned column           = s->column;
+    char     indent_char      = s->indent_char;
+    bool     checking_indent  = s->checking_indent;
+    bool     had_space_before = s->had_space_before;
+    bool     had_space_after  = s->had_space_after;
+    bool     input_eof        = s->input_eof;
+    name_p   block_close      = name_use(s->block_close);
+    errors_p errors           = errors_save();
+
+    token_t result = scanner_token(s);
+    if (s->starved)
+    {
+        RECORD(SCANNER, "Starved after %u bytes, restart token",
+               position(s->positions) - consumed);
+        position_retreat(s->positions, position(s->positions) - consumed);
+        if (s->token_start < s->input_length &&
+            scanner_resumable(s->input[s->token_start]))
+        {
+            // Check the last character again, e.g. a quote that may end a text
+            s->resume = s->input_length - 1;
+            s->resume_first = s->input[s->token_start];
+        }
+        s->input_next = input_next;
+        s->pending = pending;
+        s->token_start = s->token_end = token_end;
+        s->column = column;
+        s->indent_char = indent_char;
+        s->checking_indent = checking_indent;
+        s->had_space_before = had_space_before;
+        s->had_space_after = had_space_after;
+        s->input_eof = input_eof;
+        name_set(&s->block_close, block_close);
+        tree_dispose(&s->scanned.tree);
+        text_dispose(&s->source);
+        errors_clear(errors);
+        result = tokNONE;
+    }
+    else
+    {
+        errors_commit(errors);
+    }
+    name_dispose(&block_close);
+    return result;
+}
+
+
+static void scanner_skipped(scanner_p s, text_p *comment,
+                            const char *data, size_t length)
+// ----------------------------------------------------------------------------
+//   Process skipped characters, appending them to comment if not NULL
+// ----------------------------------------------------------------------------
+//   Lines are copied in one block, except for the indentation that follows
+//   a newline, which is stripped up to the current indentation level
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        if (s->checking_indent)
         {
-            if (isspace(c))
+            char c = data[i];
+            if (c == '\n')
             {
-                skip = s->column < s->indent;
+                // New line: start counting indentation
+                s->column = 0;
+                if (comment)
+                    text_append_data(comment, 1, &c);
+                i++;
+                continue;
             }
-            else
+            if (scanner_char_is(c, SCANNER_BLANK))
             {
-                s->checking_indent = false;
-                skip = false;
+                if (comment && s->column >= s->indent)
+                    text_append_data(comment, 1, &c);
+                i++;
+                continue;
             }
+            s->checking_indent = false;
         }
 
-        if (c == *match)
+        // Copy up to and including the next newline
+        const char *eol = memchr(data + i, '\n', length - i);
+        size_t end = eol ? (size_t) (eol - data) + 1 : length;
+        if (comment)
+            text_append_data(comment, end - i, data + i);
+        if (eol)
         {
-            match++;
+            s->checking_indent = true;
+            s->column = 0;
         }
-        else
+        i = end;
+    }
+}
+
+
+static size_t scanner_find(const char *data, size_t size,
+                           const char *eoc, size_t length, bool *found)
+// ----------------------------------------------------------------------------
+//   Find the closing marker in data, or where a partial match may begin
+// ----------------------------------------------------------------------------
+//   memchr looks for the first character of the marker, and we only compare
+//   the rest where it is found. If the marker is not found, the returned
+//   offset is where a match may start, but that requires more input.
+{
+    size_t i = 0;
+    *found = false;
+    while (i < size)
+    {
+        const char *first = memchr(data + i, eoc[0], size - i);
+        if (!first)
+            return size;
+        i = first - data;
+        size_t avail = size - i;
+        if (avail < length)
         {
-            // Backtrack in case we had something like **/
-            unsigned max = match - eoc;
-            const char *end = text_data(comment) + text_length(comment);
-            for (unsigned i = 0; i < max; i++)
-            {
-                // Stop as soon as we start matching again
-                if (memcmp(eoc, end - max + i, match - eoc) == 0)
-                    break;
-                match--;
-            }
+            if (memcmp(first, eoc, avail) == 0)
+                return i;
         }
-
-        if (!skip)
+        else if (memcmp(first, eoc, length) == 0)
         {
-            char ch = (char) c;
-            text_append_data(&comment, 1, &ch);
+            *found = true;
+            return i;
         }
+        i++;
     }
-
-    // Strip the termination from the comment being returned
-    size_t comment_length = text_length(comment) - (match - eoc);
-    text_range(&comment, 0, comment_length);
-    return comment;
+    return size;
 }
 
 
-unsigned scanner_open_parenthese(scanner_p s)
+text_p scanner_skip(scanner_p s, name_p closing)
 // ----------------------------------------------------------------------------
-//   Opening some parenthese: remember the settingIndent value
+//    Read ahead until we find the closing marker (for comments or long text)
+// ----------------------------------------------------------------------------
+//    The input is searched for the marker a chunk at a time, and the body
+//    of the comment is copied in blocks. A marker split across two chunks
+//    is kept in the input buffer until the next chunk is read.
+//    With pushed input, we return NULL if we run out of input before the
+//    marker, and the next call continues the same comment.
+{
+    const char *eoc      = name_data(closing);
+    size_t      length   = name_length(closing);
+    unsigned    position = scanner_position(s);
+    text_p      comment  = s->skipped;
+    size_t      skipped  = 0;
+    bool        found    = length == 0;
+
+    // Continue a suspended comment, or start a new one
+    if (comment)
+    {
+        s->skipped = NULL;
+        text_unref(comment);
+    }
+    else
+    {
+        comment = text_new(position, 0, NULL);
+    }
+
+    // Clear source and scanned value if any
+    scanner_spelling(s, position);
+    text_dispose(&s->scanned.text);
+
+    while (!found && !tree_budget_exceeded())
+    {
+        const char *data = s->input + s->input_next;
+        size_t avail = s->input_length - s->input_next;
+        size_t body = scanner_find(data, avail, eoc, length, &found);
+        scanner_skipped(s, &comment, data, body);
+        skipped += body;
+        s->input_next += body;
+        if (found)
+        {
+            // Process the marker for indentation, but do not return it
+            scanner_skipped(s, NULL, data + body, length);
+            skipped += length;
+            s->input_next += length;
+            break;
+        }
+
+        // Keep any partial match in the buffer while reading more input
+        s->token_start = s->token_end = s->input_next;
+        if (!scanner_refill(s))
+        {
+            if (s->starved)
+            {
+                // Wait for more pushed input, keeping any partial match
+                s->skipped = text_use(comment);
+                comment = NULL;
+                break;
+            }
+
+            // End of input: what looked like a partial match is text
+            s->input_next = s->token_start;
+            data = s->input + s->input_next;
+            avail = s->input_length - s->input_next;
+            scanner_skipped(s, &comment, data, avail);
+            s->input_next += avail;
+            skipped += avail + 1;
+            s->input_eof = true;
+            break;
+        }
+        s->input_next = s->token_start;
+    }
+
+    // Consume skipped characters, including any pending ones
+    position_advance(s->positions, skipped);
+    s->pending = s->pending > skipped ? s->pending - skipped : 0;
+    s->token_start = s->token_end = s->input_next;
+    return comment;
+}
+
+
+unsigned scanner_open_parenthese(scanner_p s)
+// ----------------------------------------------------------------------------
+//   Opening some parenthese: remember the settingIndent value
 // ----------------------------------------------------------------------------
 {
     unsigned result = s->indent;
@@ -922,5 +2119,1139 @@ void scanner_close_parenthese(scanner_p s, unsigned old_indent)
 }
 
 
+
+// ============================================================================
+//
+//    Lexing a whole input at once
+//
+// ============================================================================
+
+typedef struct scanner_chunk
+// ----------------------------------------------------------------------------
+//   A range of input lexed by a separate thread for scanner_lex
+// ----------------------------------------------------------------------------
+{
+    syntax_p            syntax;         // Syntax used to scan the chunk
+    const char *        input;          // First byte of the chunk
+    size_t              length;         // Length of the chunk
+    uint32_t            offset;         // Offset of the chunk in tokens
+    srcpos_t            base;           // Source position of offset 0
+    bool                last;           // Chunk runs to the end of input
+    bool                started;        // A thread was started for chunk
+    bool                valid;          // Tokens are usable as is
+    bool                opened;         // A block was opened in the chunk
+    char                indent_char;    // Indentation character in chunk
+    name_p              block_close;    // Block closing at end of chunk
+    scanner_tokens_t    tokens;         // Tokens, with raw line starts
+#ifdef HAVE_LIBPTHREAD
+    pthread_t           thread;         // Thread lexing the chunk
+#endif // HAVE_LIBPTHREAD
+} scanner_chunk_t, *scanner_chunk_p;
+
+
+static void scanner_tokens_push(scanner_tokens_p tokens, scanner_token_p token)
+// ----------------------------------------------------------------------------
+//   Append a token, which gives ownership of its scanned value to tokens
+// ----------------------------------------------------------------------------
+{
+    if (tokens->count == tokens->capacity)
+    {
+        tokens->capacity = tokens->capacity ? 2 * tokens->capacity : 256;
+        tokens->tokens = realloc(tokens->tokens,
+                                 tokens->capacity * sizeof(scanner_token_t));
+    }
+    tokens->tokens[tokens->count++] = *token;
+}
+
+
+static bool scanner_token_has_tree(unsigned kind)
+// ----------------------------------------------------------------------------
+//   Check if the value of a packed token is a tree owned by the token
+// ----------------------------------------------------------------------------
+{
+    switch(kind)
+    {
+    case tokTEXT:
+    case tokLONGTEXT:
+    case tokBLOB:
+    case tokNAME:
+    case tokSYMBOL:
+    case tokOPEN:
+    case tokCLOSE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static void scanner_tokens_dispose(scanner_tokens_p tokens)
+// ----------------------------------------------------------------------------
+//   Dispose of the scanned values and of the recorded tokens
+// ----------------------------------------------------------------------------
+{
+    for (size_t t = 0; t < tokens->count; t++)
+        if (scanner_token_has_tree(tokens->tokens[t].kind))
+            tree_dispose(&tokens->tokens[t].value.tree);
+    free(tokens->tokens);
+    tokens->tokens = NULL;
+    tokens->count = 0;
+    tokens->capacity = 0;
+}
+
+
+void scanner_tokens_delete(scanner_tokens_p tokens)
+// ----------------------------------------------------------------------------
+//   Delete tokens returned by scanner_lex
+// ----------------------------------------------------------------------------
+{
+    scanner_tokens_dispose(tokens);
+    free(tokens);
+}
+
+
+static bool scanner_lex_next(scanner_p s, srcpos_t base, scanner_token_p token)
+// ----------------------------------------------------------------------------
+//   Scan the next token for scanner_lex, return false after the last one
+// ----------------------------------------------------------------------------
+//   Comments are skipped and long texts are gathered like in the parser.
+//   We stop after a 'syntax' statement or the opening of a child syntax,
+//   since they change how the rest of the input is scanned.
+{
+    for (;;)
+    {
+        token_t  tok     = scanner_token(s);
+        srcpos_t pos     = s->token_position;
+        name_p   closing = NULL;
+
+        token->kind = tok;
+        token->had_space_before = s->had_space_before;
+        token->had_space_after = s->had_space_after;
+        token->offset = pos - base;
+        token->length = scanner_token_length(s);
+        token->end = position(s->positions) - base;
+        token->value.natural = 0;
+        if (scanner_token_has_tree(tok))
+        {
+            token->value.tree = s->scanned.tree;
+            s->scanned.tree = NULL;
+        }
+        else if (tok == tokINTEGER || tok == tokCHARACTER || tok == tokREAL)
+        {
+            token->value = s->value;
+        }
+        else if (tok == tokNEWLINE && s->raw_indent)
+        {
+            // Raw line starts span the blanks until the first character
+            token->length = scanner_position(s) - pos;
+            token->value.column = s->column;
+        }
+        tree_dispose(&s->scanned.tree);
+
+        if (tok != tokNAME && tok != tokSYMBOL)
+            return tok != tokEOF;
+
+        name_p name = token->value.name;
+        if (syntax_is_comment(s->syntax, name, &closing))
+        {
+            text_p comment = text_use(scanner_skip(s, closing));
+            text_dispose(&comment);
+            name_dispose(&closing);
+            name_dispose(&token->value.name);
+            continue;
+        }
+        if (syntax_is_text(s->syntax, name, &closing))
+        {
+            text_p text = scanner_skip(s, closing);
+            token->kind = tokLONGTEXT;
+            token->length = position(s->positions) - pos;
+            token->end = position(s->positions) - base;
+            token->value.tree = tree_use((tree_p)
+                delimited_text_new(pos, text, name, closing));
+            name_dispose(&name);
+            name_dispose(&closing);
+            return true;
+        }
+        if (name_eq(name, "syntax") || syntax_is_special(s->syntax, name,
+                                                         &closing))
+        {
+            RECORD(SCANNER, "Lexing stops at pos %u for %t", pos, name);
+            name_dispose(&closing);
+            return false;
+        }
+        return true;
+    }
+}
+
+
+static void scanner_lex_line(scanner_p s,
+                             scanner_tokens_p tokens, scanner_token_p line)
+// ----------------------------------------------------------------------------
+//   Record the indentation token for a raw line start
+// ----------------------------------------------------------------------------
+//   If the tokens are for the parser, line starts are left raw, because
+//   the parser changes how indentation is counted inside parentheses.
+//   It will compute indentation when replaying the tokens.
+{
+    scanner_token_t token = *line;
+    if (tokens->count)
+        token.had_space_after =
+            tokens->tokens[tokens->count - 1].had_space_after;
+    if (!tokens->raw_indent)
+    {
+        s->column = token.value.column;
+        token.kind = scanner_indentation(s, tokens->position + token.offset);
+        token.value.natural = 0;
+    }
+    scanner_tokens_push(tokens, &token);
+}
+
+
+static void scanner_lex_unindent(scanner_p s, scanner_tokens_p tokens)
+// ----------------------------------------------------------------------------
+//   Record the additional unindents after unindenting by several levels
+// ----------------------------------------------------------------------------
+//   Like in scanner_read, they are reported at the first character of the
+//   line, and not at all if the input ends there.
+{
+    if (tokens->raw_indent)
+        return;
+
+    scanner_token_t token = tokens->tokens[tokens->count - 1];
+    token.kind = tokUNINDENT;
+    token.offset += token.length;
+    token.length = 0;
+    token.had_space_before = true;
+    while (indents_length(s->indents) > 0 &&
+           indents_top(s->indents) > s->indent)
+    {
+        indents_pop(&s->indents);
+        scanner_tokens_push(tokens, &token);
+    }
+}
+
+
+static void *scanner_lex_chunk(void *data)
+// ----------------------------------------------------------------------------
+//   Lex a chunk of input, normally in a separate thread
+// ----------------------------------------------------------------------------
+//   The chunk begins at the start of a line, but the indentation and the
+//   blocks opened before it are not known. Line starts are recorded with
+//   their column, and reconciled by scanner_lex. Errors are only counted,
+//   and a chunk that has some is scanned again in the main thread.
+{
+    scanner_chunk_p chunk     = data;
+    positions_t     positions = { chunk->base + chunk->offset, NULL };
+    scanner_p       s         = scanner_new(&positions, chunk->syntax);
+    scanner_token_t token;
+
+    // Nothing can be read after the chunk
+    s->input = chunk->input;
+    s->input_length = chunk->length;
+    s->pushed = true;
+    s->finished = true;
+    s->checking_indent = true;
+    s->raw_indent = true;
+    s->packed = true;
+
+    errors_mute(true);
+    while (chunk->valid)
+    {
+        bool more = scanner_lex_next(s, chunk->base, &token);
+        scanner_tokens_push(&chunk->tokens, &token);
+        if (token.kind == tokOPEN)
+            chunk->opened = true;
+        if (errors_mute(true) || (!more && token.kind != tokEOF))
+            chunk->valid = false;
+        if (!more)
+            break;
+    }
+    errors_mute(false);
+    chunk->indent_char = s->indent_char;
+    name_set(&chunk->block_close, s->block_close);
+    scanner_delete(s);
+
+    // Check that nothing continues after the chunk, like a blob could
+    scanner_token_p t = chunk->tokens.tokens;
+    size_t          n = chunk->tokens.count;
+    if (chunk->valid)
+        chunk->valid = n >= 2 && t[0].kind == tokNEWLINE;
+    if (chunk->valid && !chunk->last)
+        chunk->valid = (n >= 3 &&
+                        t[n-2].kind == tokNEWLINE &&
+                        t[n-3].kind != tokBLOB);
+    RECORD(SCANNER, "Lexed chunk at offset %u, %zu tokens, %s",
+           chunk->offset, n, chunk->valid ? "valid" : "invalid");
+    return chunk;
+}
+
+
+static size_t scanner_lex_split(scanner_p s, unsigned threads,
+                                srcpos_t base, scanner_chunk_p *result)
+// ----------------------------------------------------------------------------
+//   Split the input at line boundaries and start lexing chunks in threads
+// ----------------------------------------------------------------------------
+//   The first chunk is not returned, since it is lexed by the main thread.
+//   Splitting requires the rest of the input to be in memory, which is the
+//   case for mapped files. Input is lexed serially while a memory budget
+//   is charged, since the budget only sees allocations in its own thread.
+{
+    *result = NULL;
+
+#ifdef HAVE_LIBPTHREAD
+    const char *input  = s->input + s->input_next;
+    size_t      length = s->input_length - s->input_next;
+    if (threads < 2 || s->input == s->buffer || s->pushed || s->pending ||
+        length < 2 * SCANNER_LEX_CHUNK || length > UINT32_MAX ||
+        tree_budget())
+        return 0;
+
+    size_t count = length / SCANNER_LEX_CHUNK;
+    if (count > threads)
+        count = threads;
+    size_t size = length / count;
+
+    scanner_chunk_p chunks = calloc(count, sizeof(scanner_chunk_t));
+    size_t          found  = 0;
+    for (size_t c = 1; c < count; c++)
+    {
+        size_t from = c * size;
+        const char *eol = memchr(input + from, '\n', length - from);
+        if (!eol || (size_t) (eol + 1 - input) >= length)
+            break;
+        size_t start = eol + 1 - input;
+        if (found && start <= chunks[found-1].offset)
+            continue;
+
+        scanner_chunk_p chunk = &chunks[found++];
+        chunk->syntax = s->syntax;
+        chunk->input = input + start;
+        chunk->offset = start;
+        chunk->base = base;
+        chunk->valid = true;
+    }
+    for (size_t c = 0; c < found; c++)
+    {
+        scanner_chunk_p chunk = &chunks[c];
+        size_t end = c + 1 < found ? chunks[c+1].offset : length;
+        chunk->length = end - chunk->offset;
+        chunk->last = c + 1 == found;
+        chunk->started = pthread_create(&chunk->thread, NULL,
+                                        scanner_lex_chunk, chunk) == 0;
+        if (!chunk->started)
+            chunk->valid = false;
+    }
+
+    RECORD(SCANNER, "Lexing %zu bytes in %zu chunks", length, found + 1);
+    if (!found)
+        free(chunks);
+    else
+        *result = chunks;
+    return found;
+#else // !HAVE_LIBPTHREAD
+    return 0;
+#endif // HAVE_LIBPTHREAD
+}
+
+
+static void scanner_lex_join(scanner_chunk_p chunk)
+// ----------------------------------------------------------------------------
+//   Wait for the thread lexing the chunk to finish
+// ----------------------------------------------------------------------------
+{
+#ifdef HAVE_LIBPTHREAD
+    if (chunk->started)
+        pthread_join(chunk->thread, NULL);
+#endif // HAVE_LIBPTHREAD
+    chunk->started = false;
+}
+
+
+static void scanner_lex_drop(scanner_chunk_p chunk)
+// ----------------------------------------------------------------------------
+//   Release the tokens of a chunk that were not used
+// ----------------------------------------------------------------------------
+{
+    scanner_lex_join(chunk);
+    scanner_tokens_dispose(&chunk->tokens);
+    name_dispose(&chunk->block_close);
+}
+
+
+static bool scanner_lex_accept(scanner_p s, scanner_chunk_p chunk)
+// ----------------------------------------------------------------------------
+//   Check if the tokens of a chunk are consistent with the scanner state
+// ----------------------------------------------------------------------------
+//   The chunk was lexed without knowing the indentation character or the
+//   closing of the innermost block opened before it. The closing can be
+//   found later as a name or symbol, but not as a prefix of a longer symbol,
+//   since scanning the symbol would then stop early.
+{
+    if (!chunk->valid)
+        return false;
+    if (s->indent_char && chunk->indent_char &&
+        s->indent_char != chunk->indent_char)
+        return false;
+
+    name_p close = s->block_close;
+    if (!close)
+        return true;
+
+    const char *    spelling = name_data(close);
+    size_t          length   = name_length(close);
+    scanner_token_p t        = chunk->tokens.tokens;
+    size_t          count    = chunk->tokens.count;
+    for (size_t i = 1; i < count && t[i].kind != tokOPEN; i++)
+    {
+        if (t[i].kind == tokNAME || t[i].kind == tokSYMBOL)
+        {
+            if (name_compare(t[i].value.name, close) == 0)
+                break;
+            if (t[i].kind == tokSYMBOL && t[i].length > length &&
+                memcmp(chunk->input + (t[i].offset - chunk->offset),
+                       spelling, length) == 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+static void scanner_lex_splice(scanner_p s,
+                               scanner_tokens_p tokens, scanner_chunk_p chunk)
+// ----------------------------------------------------------------------------
+//   Record the tokens of an accepted chunk that follow its first line start
+// ----------------------------------------------------------------------------
+//   For a chunk that is not the last one, the final line start and end of
+//   input are left out, since the line continues in the next chunk.
+{
+    scanner_token_p t     = chunk->tokens.tokens;
+    size_t          count = chunk->tokens.count - (chunk->last ? 0 : 2);
+    name_p          close = s->block_close;
+
+    for (size_t i = 1; i < count; i++)
+    {
+        scanner_token_t token = t[i];
+        t[i].value.tree = NULL;
+        switch(token.kind)
+        {
+        case tokNEWLINE:
+            scanner_lex_unindent(s, tokens);
+            scanner_lex_line(s, tokens, &token);
+            continue;
+        case tokOPEN:
+            close = NULL;
+            break;
+        case tokNAME:
+        case tokSYMBOL:
+            if (close && name_compare(token.value.name, close) == 0)
+            {
+                token.kind = tokCLOSE;
+                close = NULL;
+                name_dispose(&s->block_close);
+            }
+            break;
+        case tokEOF:
+            token.had_space_after =
+                tokens->tokens[tokens->count - 1].had_space_after;
+            scanner_tokens_push(tokens, &token);
+            continue;
+        default:
+            break;
+        }
+        scanner_lex_unindent(s, tokens);
+        scanner_tokens_push(tokens, &token);
+    }
+
+    if (chunk->opened)
+        name_set(&s->block_close, chunk->block_close);
+    if (!s->indent_char)
+        s->indent_char = chunk->indent_char;
+}
+
+
+static void scanner_lex_seek(scanner_p s, size_t index, srcpos_t pos,
+                             bool line_start)
+// ----------------------------------------------------------------------------
+//   Move the scanner forward to the given input index and position
+// ----------------------------------------------------------------------------
+{
+    assert(pos >= position(s->positions) && "Can only seek forward");
+    position_advance(s->positions, pos - position(s->positions));
+    s->input_next = index;
+    s->pending = 0;
+    s->token_start = s->token_end = index;
+    s->input_eof = false;
+    s->checking_indent = line_start;
+    s->column = 0;
+}
+
+
+scanner_tokens_p scanner_lex(scanner_p s, unsigned threads)
+// ----------------------------------------------------------------------------
+//   Record the tokens of the rest of the input
+// ----------------------------------------------------------------------------
+//   This returns the tokens scanner_read would return, skipping comments
+//   and gathering long texts like the parser does. It stops after the end
+//   of input, or after a token that changes how the rest of the input is
+//   scanned, in which case scanner_read continues from there.
+//
+//   When the input is in memory, it is split at line boundaries, and the
+//   chunks after the first one are lexed by other threads while the main
+//   thread lexes the first one. When the main thread reaches the beginning
+//   of a chunk, it takes the tokens from that chunk if they are consistent,
+//   and does the same with following chunks. Indentation is decided from
+//   the columns recorded for line starts as tokens are taken, unless the
+//   raw_indent flag of the scanner asks to leave them raw. A chunk that
+//   is not consistent is scanned again by the main thread, for example if a
+//   comment, text or blob continues from the previous chunk, or in case of
+//   errors, so that they are reported in order.
+{
+    assert((!s->pushed || s->finished) && "Cannot lex input being pushed");
+
+    // Whole files in memory can be replayed from the persistent cache
+    if (s->cache && s->input != s->buffer && !s->input_next && !s->pending)
+        return scanner_cache_lex(s, threads);
+
+    srcpos_t         base   = position(s->positions);
+    size_t           origin = s->input_next;
+    const char *     input  = s->input;
+    scanner_tokens_p tokens = malloc(sizeof(scanner_tokens_t));
+    scanner_chunk_p  chunks = NULL;
+    size_t           count  = scanner_lex_split(s, threads, base, &chunks);
+    size_t           next   = 0;
+    bool             raw    = s->raw_indent;
+    bool             packed = s->packed;
+    bool             merge  = false;
+    uint32_t         merged = 0;
+    bool             more   = true;
+
+    tokens->position = base;
+    tokens->source = input != s->buffer ? input + origin : NULL;
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->next = 0;
+    tokens->raw_indent = raw;
+    tokens->tokens = NULL;
+
+    s->raw_indent = true;
+    s->packed = true;
+    while (more && position(s->positions) - base < UINT32_MAX)
+    {
+        scanner_token_t token;
+        more = scanner_lex_next(s, base, &token);
+        if (token.kind != tokNEWLINE)
+        {
+            scanner_tokens_push(tokens, &token);
+            continue;
+        }
+
+        // After a chunk we did not take, the line start began before it
+        if (merge)
+        {
+            token.length += token.offset - merged;
+            token.offset = merged;
+            token.had_space_before = true;
+            merge = false;
+        }
+        scanner_lex_line(s, tokens, &token);
+
+        // Check if the next chunk begins in the blanks of this line start
+        uint32_t end = token.offset + token.length;
+        while (next < count && chunks[next].offset <= token.offset)
+            scanner_lex_drop(&chunks[next++]);
+        if (next >= count || chunks[next].offset > end + 1)
+            continue;
+
+        scanner_chunk_p chunk = &chunks[next++];
+        scanner_lex_join(chunk);
+        scanner_token_p first = chunk->tokens.tokens;
+        if (!scanner_lex_accept(s, chunk) ||
+            first->offset + first->length != end ||
+            first->value.column != token.value.column)
+        {
+            scanner_lex_drop(chunk);
+            continue;
+        }
+
+        // Take tokens from the following chunks as long as we can
+        for (;;)
+        {
+            scanner_lex_splice(s, tokens, chunk);
+            if (chunk->last)
+            {
+                assert(s->input == input && "Input changed while lexing");
+                scanner_lex_seek(s, origin + chunk->offset + chunk->length,
+                                 base + chunk->offset + chunk->length, false);
+                scanner_lex_drop(chunk);
+                more = false;
+                break;
+            }
+
+            scanner_token_t line = chunk->tokens.tokens[chunk->tokens.count-2];
+            scanner_lex_drop(chunk);
+            chunk = &chunks[next++];
+            scanner_lex_join(chunk);
+            if (!scanner_lex_accept(s, chunk))
+            {
+                // Scan the chunk in the main thread, from its first line
+                assert(s->input == input && "Input changed while lexing");
+                scanner_lex_seek(s, origin + chunk->offset,
+                                 base + chunk->offset, true);
+                scanner_lex_drop(chunk);
+                merge = true;
+                merged = line.offset;
+                break;
+            }
+
+            // The line start at the end of a chunk ends in the next one
+            first = chunk->tokens.tokens;
+            line.length = first->offset + first->length - line.offset;
+            line.end = first->end;
+            line.value.column = first->value.column;
+            scanner_lex_line(s, tokens, &line);
+        }
+    }
+    s->raw_indent = raw;
+    s->packed = packed;
+
+    while (next < count)
+        scanner_lex_drop(&chunks[next++]);
+    free(chunks);
+
+    RECORD(SCANNER, "Lexed %zu tokens", tokens->count);
+    return tokens;
+}
+
+
+scanner_tokens_p scanner_tokenize(scanner_p s, unsigned threads)
+// ----------------------------------------------------------------------------
+//   Record the packed tokens for all the rest of the input
+// ----------------------------------------------------------------------------
+//   This is for tools that need tokens but no parse tree. Unlike scanner_lex,
+//   this does not stop at a 'syntax' statement: the syntax description that
+//   follows is read into the syntax like in the parser, and is not recorded.
+//   Child syntaxes are only used by the parser. Offsets are 32-bit, so that
+//   for inputs larger than 4GB, this stops early and should be called again.
+{
+    scanner_tokens_p tokens = scanner_lex(s, threads);
+    while (tokens->count)
+    {
+        scanner_token_p last = &tokens->tokens[tokens->count - 1];
+        if (last->kind != tokNAME && last->kind != tokSYMBOL)
+            break;
+        if (name_eq(last->value.name, "syntax"))
+            syntax_read(s->syntax, s);
+        if (position(s->positions) - tokens->position >= UINT32_MAX)
+            break;
+
+        // Append the following tokens, which we take ownership of
+        scanner_tokens_p more = scanner_lex(s, threads);
+        uint32_t delta = more->position - tokens->position;
+        for (size_t t = 0; t < more->count; t++)
+        {
+            scanner_token_p token = &more->tokens[t];
+            token->offset += delta;
+            token->end += delta;
+            scanner_tokens_push(tokens, token);
+        }
+        more->count = 0;
+        scanner_tokens_delete(more);
+    }
+    return tokens;
+}
+
+
+token_t scanner_replay(scanner_p s, scanner_tokens_p tokens)
+// ----------------------------------------------------------------------------
+//   Return the next recorded token like scanner_read, or tokNONE at the end
+// ----------------------------------------------------------------------------
+//   The scanned value, position and spacing of the token are set in the
+//   scanner like when reading it. Raw line starts are resolved here, so
+//   that scanner_open_parenthese has the same effect as with scanner_read.
+//   Like with scanner_read, the end of input is returned repeatedly.
+{
+    size_t next = tokens->next;
+    if (next >= tokens->count)
+    {
+        if (!next || tokens->tokens[next - 1].kind != tokEOF)
+            return tokNONE;
+        next--;
+    }
+
+    scanner_token_p token = &tokens->tokens[next];
+    srcpos_t        pos   = tokens->position + token->offset;
+    tree_dispose(&s->scanned.tree);
+
+    // Check if we unindented far enough for multiple indents
+    if (tokens->raw_indent && token->kind != tokEOF &&
+        indents_length(s->indents) > 0 && indents_top(s->indents) > s->indent)
+    {
+        RECORD(SCANNER, "Replay at pos %u UNINDENT, indent %u > %u",
+               pos, indents_top(s->indents), s->indent);
+        indents_pop(&s->indents);
+        s->had_space_before = true;
+        return tokUNINDENT;
+    }
+
+    tokens->next = next + 1;
+    s->token_position = pos;
+    s->had_space_before = token->had_space_before;
+    s->had_space_after = token->had_space_after;
+    switch(token->kind)
+    {
+    case tokINTEGER:
+        natural_set(&s->scanned.natural,
+                    natural_new(pos, token->value.natural));
+        break;
+    case tokREAL:
+        real_set(&s->scanned.real, real_new(pos, token->value.real));
+        break;
+    case tokCHARACTER:
+        character_set(&s->scanned.character,
+                      character_new(pos, token->value.natural));
+        break;
+    case tokNEWLINE:
+        if (tokens->raw_indent)
+        {
+            s->column = token->value.column;
+            return scanner_indentation(s, pos);
+        }
+        break;
+    default:
+        if (scanner_token_has_tree(token->kind))
+            tree_set(&s->scanned.tree, token->value.tree);
+        break;
+    }
+    return token->kind;
+}
+
+
+
+
+
+// ============================================================================
+//
+//    Persistent token cache
+//
+// ============================================================================
+//   The tokens of a whole file are saved in the cache directory, in a file
+//   named after a hash of the file contents and a hash of the syntax.
+//   Cached tokens keep raw line starts, so that the same entry serves the
+//   parser and scanner_tokenize. Only files lexed without errors up to the
+//   end of input are cached, so that errors are reported on every run.
+
+#define SCANNER_CACHE_MAGIC     0x31304b544c58ULL       // "XLTK01"
+
+
+typedef struct scanner_cache_header
+// ----------------------------------------------------------------------------
+//    The header at the beginning of a cache file
+// ----------------------------------------------------------------------------
+{
+    uint64_t    magic;                  // Format of the cache file
+    uint64_t    content;                // Hash of the input
+    uint64_t    syntax;                 // Hash of the syntax
+    uint64_t    length;                 // Length of the input
+    uint64_t    count;                  // Number of tokens that follow
+    uint64_t    size;                   // Size of the file
+} scanner_cache_header_t;
+
+
+typedef struct scanner_cache_record
+// ----------------------------------------------------------------------------
+//    A token in a cache file, followed by the data for its tree, if any
+// ----------------------------------------------------------------------------
+//    For tokens with a tree, the value is the size of the data that follows.
+//    Long texts are followed by the offset of the text and the size of
+//    the opening, then the opening and the text.
+{
+    uint8_t     kind;                   // Token kind
+    uint8_t     spacing;                // 1 if space before, 2 if after
+    uint16_t    reserved;               // Zero
+    uint32_t    offset;                 // Offset of token from start
+    uint32_t    length;                 // Length of token spelling
+    uint32_t    end;                    // Offset of position after token
+    uint64_t    value;                  // Value, or size of tree data
+} scanner_cache_record_t;
+
+
+static uint64_t scanner_cache_hash(size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   Hash the contents of a file, eight bytes at a time
+// ----------------------------------------------------------------------------
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+    size_t   i    = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ (uint8_t) data[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+
+static char *scanner_cache_path(scanner_cache_p cache,
+                                uint64_t content, uint64_t syntax)
+// ----------------------------------------------------------------------------
+//   Return the name of the cache file for the given hashes, to free
+// ----------------------------------------------------------------------------
+{
+    size_t size = strlen(cache->directory) + 48;
+    char  *path = malloc(size);
+    snprintf(path, size, "%s/%016llx%016llx.xltokens", cache->directory,
+             (unsigned long long) content, (unsigned long long) syntax);
+    return path;
+}
+
+
+static bool scanner_cache_get(const char **data, const char *last,
+                              size_t size, void *value)
+// ----------------------------------------------------------------------------
+//   Read some bytes from a cache file, return false if there are not enough
+// ----------------------------------------------------------------------------
+{
+    if ((size_t) (last - *data) < size)
+        return false;
+    memcpy(value, *data, size);
+    *data += size;
+    return true;
+}
+
+
+static scanner_tokens_p scanner_cache_load(scanner_p s, const char *path,
+                                           uint64_t content, uint64_t syntax)
+// ----------------------------------------------------------------------------
+//   Load the cached tokens for the input, or return NULL if not cached
+// ----------------------------------------------------------------------------
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    scanner_cache_header_t header;
+    char *data = NULL;
+    bool  ok = fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == SCANNER_CACHE_MAGIC &&
+        header.content == content &&
+        header.syntax == syntax &&
+        header.length == s->input_length &&
+        header.size >= sizeof(header);
+    if (ok)
+    {
+        size_t size = header.size - sizeof(header);
+        data = malloc(size + 1);
+        ok = fread(data, 1, size + 1, file) == size;
+    }
+    fclose(file);
+    if (!ok)
+    {
+        free(data);
+        RECORD(SCANNER, "Cache file %s is not valid", path);
+        return NULL;
+    }
+
+    srcpos_t         base   = position(s->positions);
+    const char *     next   = data;
+    const char *     last   = data + (header.size - sizeof(header));
+    scanner_tokens_p tokens = malloc(sizeof(scanner_tokens_t));
+    tokens->position = base;
+    tokens->source = s->input;
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->next = 0;
+    tokens->raw_indent = true;
+    tokens->tokens = NULL;
+
+    for (uint64_t t = 0; ok && t < header.count; t++)
+    {
+        scanner_cache_record_t record;
+        scanner_token_t        token;
+        ok = scanner_cache_get(&next, last, sizeof(record), &record);
+        if (!ok)
+            break;
+
+        srcpos_t pos = base + record.offset;
+        token.kind = record.kind;
+        token.had_space_before = (record.spacing & 1) != 0;
+        token.had_space_after = (record.spacing & 2) != 0;
+        token.offset = record.offset;
+        token.length = record.length;
+        token.end = record.end;
+        token.value.natural = 0;
+        if (!scanner_token_has_tree(record.kind))
+        {
+            memcpy(&token.value, &record.value, sizeof(token.value));
+            scanner_tokens_push(tokens, &token);
+            continue;
+        }
+
+        // Check that the data for the tree is in the file
+        uint64_t size = record.value;
+        uint32_t inner = 0, opening = 0;
+        if (record.kind == tokLONGTEXT)
+            ok = scanner_cache_get(&next, last, sizeof(inner), &inner) &&
+                scanner_cache_get(&next, last, sizeof(opening), &opening) &&
+                (size_t) (last - next) >= opening;
+        if (!ok || (size_t) (last - next) < opening + size)
+        {
+            ok = false;
+            break;
+        }
+
+        tree_p tree = NULL;
+        switch(record.kind)
+        {
+        case tokTEXT:
+            tree = (tree_p) text_new(pos, size, next);
+            break;
+        case tokBLOB:
+            tree = (tree_p) blob_new(pos, size, next);
+            break;
+        case tokLONGTEXT:
+        {
+            name_p open = name_intern(opening, next);
+            name_p close = NULL;
+            if (s->syntax && syntax_is_text(s->syntax, open, &close))
+            {
+                text_p text = text_new(base + inner, size, next + opening);
+                tree = (tree_p) delimited_text_new(pos, text, open, close);
+                name_dispose(&close);
+            }
+            break;
+        }
+        default:
+            tree = (tree_p) name_intern(size, next);
+            break;
+        }
+        next += opening + size;
+        if (!tree)
+        {
+            ok = false;
+            break;
+        }
+        token.value.tree = tree_use(tree);
+        scanner_tokens_push(tokens, &token);
+    }
+    free(data);
+
+    // The last token must be the end of input
+    if (!ok || next != last || !tokens->count ||
+        tokens->tokens[tokens->count - 1].kind != tokEOF)
+    {
+        RECORD(SCANNER, "Cache file %s is corrupt", path);
+        scanner_tokens_delete(tokens);
+        return NULL;
+    }
+
+    // Move the scanner to the end of input, like after scanner_lex
+    scanner_lex_seek(s, s->input_length,
+                     base + tokens->tokens[tokens->count - 1].end, false);
+    return tokens;
+}
+
+
+static void scanner_cache_put(FILE *file, size_t size, const void *data)
+// ----------------------------------------------------------------------------
+//   Write some bytes to a cache file
+// ----------------------------------------------------------------------------
+{
+    if (size)
+        fwrite(data, 1, size, file);
+}
+
+
+static void scanner_cache_save(scanner_p s, scanner_tokens_p tokens,
+                               const char *path, size_t length,
+                               uint64_t content, uint64_t syntax)
+// ----------------------------------------------------------------------------
+//   Save the tokens for the input in the cache
+// ----------------------------------------------------------------------------
+//   The file is written under a temporary name and then renamed, so that
+//   other processes never read a partial file under the final name.
+{
+#ifdef HAVE_SYS_STAT_H
+    mkdir(s->cache->directory, 0777);
+#endif // HAVE_SYS_STAT_H
+
+    size_t size = strlen(path) + 5;
+    char  *temp = malloc(size);
+    snprintf(temp, size, "%s.tmp", path);
+    FILE  *file = fopen(temp, "wb");
+    if (!file)
+    {
+        RECORD(SCANNER, "Unable to write cache file %s", temp);
+        free(temp);
+        return;
+    }
+
+    scanner_cache_header_t header;
+    header.magic = SCANNER_CACHE_MAGIC;
+    header.content = content;
+    header.syntax = syntax;
+    header.length = length;
+    header.count = tokens->count;
+    header.size = 0;
+    scanner_cache_put(file, sizeof(header), &header);
+
+    for (size_t t = 0; t < tokens->count; t++)
+    {
+        scanner_token_p        token = &tokens->tokens[t];
+        scanner_cache_record_t record;
+        record.kind = token->kind;
+        record.spacing = token->had_space_before | token->had_space_after << 1;
+        record.reserved = 0;
+        record.offset = token->offset;
+        record.length = token->length;
+        record.end = token->end;
+        record.value = 0;
+        if (!scanner_token_has_tree(token->kind))
+        {
+            memcpy(&record.value, &token->value, sizeof(token->value));
+            scanner_cache_put(file, sizeof(record), &record);
+            continue;
+        }
+
+        switch(token->kind)
+        {
+        case tokTEXT:
+        case tokBLOB:
+        {
+            blob_p blob = (blob_p) token->value.tree;
+            record.value = blob_length(blob);
+            scanner_cache_put(file, sizeof(record), &record);
+            scanner_cache_put(file, record.value, blob_data(blob));
+            break;
+        }
+        case tokLONGTEXT:
+        {
+            delimited_text_p text = (delimited_text_p) token->value.tree;
+            uint32_t inner = text_position(text->value) - tokens->position;
+            uint32_t opening = name_length(text->opening);
+            record.value = text_length(text->value);
+            scanner_cache_put(file, sizeof(record), &record);
+            scanner_cache_put(file, sizeof(inner), &inner);
+            scanner_cache_put(file, sizeof(opening), &opening);
+            scanner_cache_put(file, opening, name_data(text->opening));
+            scanner_cache_put(file, record.value, text_data(text->value));
+            break;
+        }
+        default:
+            record.value = name_length(token->value.name);
+            scanner_cache_put(file, sizeof(record), &record);
+            scanner_cache_put(file, record.value, name_data(token->value.name));
+            break;
+        }
+    }
+
+    // Record the size last, so that a truncated file is never valid
+    long end = ftell(file);
+    header.size = end;
+    bool ok = end > 0 &&
+        fseek(file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp, path) != 0)
+    {
+        RECORD(SCANNER, "Unable to save cache file %s", path);
+        remove(temp);
+    }
+    free(temp);
+}
+
+
+static scanner_tokens_p scanner_cache_resolve(scanner_p s,
+                                              scanner_tokens_p raw)
+// ----------------------------------------------------------------------------
+//   Decide indentation for tokens with raw line starts, like scanner_lex
+// ----------------------------------------------------------------------------
+{
+    scanner_tokens_p tokens = malloc(sizeof(scanner_tokens_t));
+    *tokens = *raw;
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->raw_indent = false;
+    tokens->tokens = NULL;
+
+    for (size_t t = 0; t < raw->count; t++)
+    {
+        scanner_token_p token = &raw->tokens[t];
+        if (token->kind != tokEOF && tokens->count)
+            scanner_lex_unindent(s, tokens);
+        if (token->kind == tokNEWLINE)
+            scanner_lex_line(s, tokens, token);
+        else
+            scanner_tokens_push(tokens, token);
+    }
+
+    // The values now belong to the resolved tokens
+    raw->count = 0;
+    scanner_tokens_delete(raw);
+    return tokens;
+}
+
+
+static scanner_tokens_p scanner_cache_lex(scanner_p s, unsigned threads)
+// ----------------------------------------------------------------------------
+//   Lex a whole file in memory, using cached tokens if the file is unchanged
+// ----------------------------------------------------------------------------
+{
+    scanner_cache_p  cache   = s->cache;
+    bool             raw     = s->raw_indent;
+    size_t           length  = s->input_length;
+    uint64_t         content = scanner_cache_hash(length, s->input);
+    uint64_t         syntax  = s->syntax ? syntax_hash(s->syntax) : 0;
+    char *           path    = scanner_cache_path(cache, content, syntax);
+    scanner_tokens_p tokens  = scanner_cache_load(s, path, content, syntax);
+
+    if (tokens)
+    {
+        cache->hits++;
+        RECORD(SCANNER, "Cache hit %s, %zu tokens", path, tokens->count);
+    }
+    else
+    {
+        cache->misses++;
+        RECORD(SCANNER, "Cache miss %s", path);
+
+        // Record errors to know if there were some, then report them
+        errors_p saved = errors_save();
+        s->cache = NULL;
+        s->raw_indent = true;
+        tokens = scanner_lex(s, threads);
+        s->raw_indent = raw;
+        s->cache = cache;
+        unsigned errors = errors_count();
+        errors_commit(saved);
+
+        if (!errors && tokens->count &&
+            tokens->tokens[tokens->count - 1].kind == tokEOF)
+            scanner_cache_save(s, tokens, path, length, content, syntax);
+    }
+    free(path);
+
+    if (!raw)
+        tokens = scanner_cache_resolve(s, tokens);
+    return tokens;
+}
+
+
+scanner_cache_p scanner_cache(scanner_p s, scanner_cache_p cache)
+// ----------------------------------------------------------------------------
+//   Set the persistent token cache used by scanner_lex, return old one
+// ----------------------------------------------------------------------------
+{
+    scanner_cache_p old = s->cache;
+    s->cache = cache;
+    return old;
+}
+
+
+
 // Generate the default handler for indents
 blob_type_handler(indents);
@@ -111,6 +111,7 @@
 #include "number.h"
 #include "position.h"
 #include "syntax.h"
+#include "utf8.h"
 
 #ifdef SCANNER_C
 #define inline extern inline
@@ -160,9 +161,78 @@ typedef union scanned
 } scanned_t, *scanned_p;
 
 
+typedef union scanner_value
+// ----------------------------------------------------------------------------
+//    Value of a packed token, where numbers do not need a tree
+// ----------------------------------------------------------------------------
+{
+    tree_p              tree;           // Texts, long texts and blobs
+    name_p              name;           // Names, symbols and blocks
+    unsigned long long  natural;        // Integers, code of characters
+    double              real;           // Real numbers
+    unsigned            column;         // Column of raw line starts
+} scanner_value_t;
+
+
 blob_type(unsigned, indents);
 
 
+typedef enum scanner_class
+// ----------------------------------------------------------------------------
+//    Character classes, following the XL rules described above
+// ----------------------------------------------------------------------------
+{
+    SCANNER_BLANK       = 0x01, // Space, tab, newline and other blanks
+    SCANNER_DIGIT       = 0x02, // Decimal digit, begins a number
+    SCANNER_LETTER      = 0x04, // ASCII letter
+    SCANNER_UNDERSCORE  = 0x08, // Underscore, used for grouping
+    SCANNER_SYMBOL      = 0x10, // Punctuation, except quotes
+    SCANNER_QUOTE       = 0x20, // Single or double quote, begins a text
+    SCANNER_UTF8_FIRST  = 0x40, // First byte of a UTF-8 sequence
+    SCANNER_UTF8_NEXT   = 0x80, // Continuation byte in a UTF-8 sequence
+
+    // Combinations used for names
+    SCANNER_NAME_FIRST  = SCANNER_LETTER|SCANNER_UTF8_FIRST|SCANNER_UTF8_NEXT,
+    SCANNER_NAME_NEXT   = SCANNER_NAME_FIRST|SCANNER_DIGIT|SCANNER_UNDERSCORE
+} scanner_class_t;
+
+
+// Class of a byte, evaluated at compile time to build scanner_classes
+// This matches the C locale, so that '_' is also a symbol like for ispunct
+#define SCANNER_CLASS(c)                                                \
+    ((c) == ' ' || ((c) >= '\t' && (c) <= '\r') ? SCANNER_BLANK       \
+     : (c) >= '0' && (c) <= '9'                 ? SCANNER_DIGIT         \
+     : ((c) >= 'A' && (c) <= 'Z') ||                                    \
+       ((c) >= 'a' && (c) <= 'z')               ? SCANNER_LETTER        \
+     : (c) == '_'               ? SCANNER_UNDERSCORE|SCANNER_SYMBOL     \
+     : (c) == '"' || (c) == '\''                ? SCANNER_QUOTE         \
+     : (c) > ' ' && (c) < 0x7F                  ? SCANNER_SYMBOL        \
+     : (c) >= 0x80 && (c) <= 0xBF               ? SCANNER_UTF8_NEXT     \
+     : (c) >= 0xC0 && (c) <= 0xFD               ? SCANNER_UTF8_FIRST    \
+     : 0)
+
+extern const uint8_t scanner_classes[256];
+
+
+// Size of the chunks read from the input stream, and history kept for unget
+#define SCANNER_BUFFER_SIZE     65536
+#define SCANNER_HISTORY         2
+
+// Smallest amount of input worth lexing in a separate thread
+#define SCANNER_LEX_CHUNK       (1 << 20)
+
+
+typedef struct scanner_cache
+// ----------------------------------------------------------------------------
+//    A persistent cache of packed tokens, shared by scanners
+// ----------------------------------------------------------------------------
+{
+    const char *directory;              // Directory holding cached tokens
+    unsigned    hits;                   // Files whose tokens were cached
+    unsigned    misses;                 // Files that had to be lexed
+} scanner_cache_t, *scanner_cache_p;
+
+
 typedef struct scanner
 // ----------------------------------------------------------------------------
 //    Internal representation of the XL scanner state
@@ -170,23 +240,78 @@ typedef struct scanner
 {
     positions_p positions;              // Description of file positions
     syntax_p    syntax;                 // Source code syntax
+    scanner_cache_p cache;              // Persistent token cache, if any
     tree_io_fn  reader;                 // Reading function
     void *      stream;                 // Stream we read from
-    text_p      source;                 // Source form of the parsed token
+    text_p      source;                 // Token spelling, built on demand
+    text_p      skipped;                // Comment suspended for more input
     scanned_t   scanned;                // Scanned result
+    scanner_value_t value;              // Scanned number, when packed
     indents_p   indents;                // Stack of indents
     name_p      block_close;            // Matching block close
     unsigned    indent;                 // Current level of indentation
     unsigned    column;                 // Current column during indentation
-    char        pending_char[2];        // Read-ahead pending chars
+    char *      buffer;                 // Buffer for chunks read from stream
+    size_t      buffer_size;            // Allocated size of the buffer
+    const char *input;                  // Current input, buffer or mapping
+    size_t      input_length;           // Bytes available in input buffer
+    size_t      input_next;             // Next byte to read in input buffer
+    unsigned    pending;                // Characters given back to input
+    size_t      token_start;            // Start of token spelling in input
+    size_t      token_end;              // End of token spelling in input
+    srcpos_t    token_position;         // Source position of token spelling
+    size_t      resume;                 // Pushed input known to be in token
+    char        resume_first;           // First character of that token
+    srcpos_t    validated;              // Position of next byte to validate
+    utf8_state_t utf8;                  // UTF-8 validation of the input
     char        indent_char;            // To detect if mixing space/tabs
     bool        checking_indent  : 1;   // At beginning of line
     bool        setting_indent   : 1;   // Parenthesis sets indent
     bool        had_space_before : 1;   // Had space before token
     bool        had_space_after  : 1;   // Had space after token
+    bool        input_eof        : 1;   // Last character read was EOF
+    bool        pushed           : 1;   // Input comes from scanner_feed
+    bool        finished         : 1;   // No more input will be pushed
+    bool        starved          : 1;   // Ran out of pushed input
+    bool        raw_indent       : 1;   // Return line starts as is
+    bool        packed           : 1;   // Scan numbers into value, no tree
+    bool        invalid_utf8     : 1;   // Reported invalid UTF-8 input
 } scanner_t, *scanner_p;
 
 
+typedef struct scanner_token
+// ----------------------------------------------------------------------------
+//    A packed token recorded by scanner_lex
+// ----------------------------------------------------------------------------
+//    Offsets are relative to the start of the recorded tokens, both for the
+//    source position and for the spelling, which is length bytes long.
+//    The end is where the scanner position was after scanning the token.
+{
+    uint8_t             kind;           // Token kind, a token_t
+    bool                had_space_before : 1;   // Had space before token
+    bool                had_space_after  : 1;   // Had space after token
+    uint32_t            offset;         // Offset of token from start
+    uint32_t            length;         // Length of token spelling
+    uint32_t            end;            // Offset of position after token
+    scanner_value_t     value;          // Value, owned by token if a tree
+} scanner_token_t, *scanner_token_p;
+
+
+typedef struct scanner_tokens
+// ----------------------------------------------------------------------------
+//    The tokens recorded by scanner_lex
+// ----------------------------------------------------------------------------
+{
+    srcpos_t        position;           // Source position of offset 0
+    const char *    source;             // Spelling at offset 0, if mapped
+    size_t          count;              // Number of tokens recorded
+    size_t          capacity;           // Number of tokens allocated
+    size_t          next;               // Next token for scanner_replay
+    bool            raw_indent;         // Line starts are left raw
+    scanner_token_p tokens;             // Recorded tokens
+} scanner_tokens_t, *scanner_tokens_p;
+
+
 extern scanner_p scanner_new(positions_p positions, syntax_p syntax);
 extern void      scanner_delete(scanner_p scan);
 extern FILE *    scanner_open(scanner_p scan, const char *file);
@@ -194,13 +319,35 @@ extern void      scanner_close(scanner_p scan, FILE *f);
 extern void      scanner_open_stream(scanner_p scan, const char *name,
                                      tree_io_fn reader, void *stream);
 extern void      scanner_close_stream(scanner_p scan, void *stream);
+extern void      scanner_open_push(scanner_p scan, const char *name);
+extern void      scanner_feed(scanner_p scan, size_t size, const char *data);
+extern void      scanner_finish(scanner_p scan);
 
 extern token_t   scanner_read(scanner_p scan);
+extern text_p    scanner_source(scanner_p scan);
 extern text_p    scanner_skip(scanner_p scan, name_p closing);
 
+extern scanner_tokens_p scanner_lex(scanner_p scan, unsigned threads);
+extern scanner_tokens_p scanner_tokenize(scanner_p scan, unsigned threads);
+extern token_t          scanner_replay(scanner_p scan, scanner_tokens_p t);
+extern void             scanner_tokens_delete(scanner_tokens_p tokens);
+extern scanner_cache_p  scanner_cache(scanner_p scan, scanner_cache_p cache);
+
 extern unsigned  scanner_open_parenthese(scanner_p s);
 extern void      scanner_close_parenthese(scanner_p s, unsigned oldIndent);
 
+inline bool      scanner_char_is(int c, unsigned classes);
+
 #undef inline
 
+
+inline bool scanner_char_is(int c, unsigned classes)
+// ----------------------------------------------------------------------------
+//   Check if a character belongs to one of the given classes
+// ----------------------------------------------------------------------------
+//   Characters may be sign-extended, and EOF falls on 0xFF, which has no class
+{
+    return (scanner_classes[(uint8_t) c] & classes) != 0;
+}
+
 #endif // SCANNER_H
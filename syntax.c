@@ -30,6 +30,13 @@
 #include <string.h>
 
 
+// Names for the special separators, shared by all syntax tables
+name_static(syntax_newline,  "\n");
+name_static(syntax_indent,   SYNTAX_INDENT);
+name_static(syntax_unindent, SYNTAX_UNINDENT);
+
+static void syntax_operators_delete(syntax_operators_p ops);
+
 syntax_p syntax_new(const char *file)
 // ----------------------------------------------------------------------------
 //   Create a new syntax configuration, normally from a syntax file
@@ -93,6 +100,12 @@ tree_p syntax_handler(tree_cmd_t cmd, tree_p tree, va_list va)
         // Return the pointer to children for that tree type
         return (tree_p) &s->filename;
 
+    case TREE_DELETE:
+        // Free the operator automaton, children are deleted by base class
+        syntax_operators_delete(s->operators);
+        s->operators = NULL;
+        break;
+
     case TREE_RENDER:
         renderer = va_arg(va, renderer_p);
 
@@ -136,15 +149,6 @@ static inline bool eq(text_p text, const char *str)
 }
 
 
-static inline void set(name_p *text, const char *str)
-// ----------------------------------------------------------------------------
-//   Replace the text
-// ----------------------------------------------------------------------------
-{
-    name_set(text, name_cnew(0, str));
-}
-
-
 static inline void set_priority(array_p *array, int priority, name_p name)
 // ----------------------------------------------------------------------------
 //   Define a priority in a priority array
@@ -181,6 +185,113 @@ static inline void set_syntax(array_p *array,
 }
 
 
+
+
+// ============================================================================
+//
+//   Operator automaton
+//
+// ============================================================================
+
+static void syntax_operators_delete(syntax_operators_p ops)
+// ----------------------------------------------------------------------------
+//   Free an operator automaton
+// ----------------------------------------------------------------------------
+{
+    if (ops)
+    {
+        free(ops->next);
+        free(ops->states);
+        free(ops);
+    }
+}
+
+
+static unsigned syntax_operators_walk(syntax_operators_p ops, name_p name)
+// ----------------------------------------------------------------------------
+//   Return the state reached after reading the name, 0 if none
+// ----------------------------------------------------------------------------
+{
+    const char *data = name_data(name);
+    size_t length = name_length(name);
+    unsigned state = SYNTAX_OPERATOR_START;
+    for (size_t i = 0; state && i < length; i++)
+    {
+        unsigned column = ops->columns[(uint8_t) data[i]];
+        state = column ? ops->next[state * ops->width + column] : 0;
+    }
+    return state;
+}
+
+
+static void syntax_compile(syntax_p syntax)
+// ----------------------------------------------------------------------------
+//   Build the automaton recognizing known operators and block openings
+// ----------------------------------------------------------------------------
+//   The automaton is a trie with one state per distinct prefix of known
+//   operators. Comment and text delimiters are part of the known operators,
+//   so the scanner returns them as a single symbol for the parser to check
+{
+    array_p  known  = syntax->known;
+    size_t   count  = array_length(known);
+    unsigned states = SYNTAX_OPERATOR_START + 1;
+
+    syntax_operators_p ops = calloc(1, sizeof(syntax_operators_t));
+    ops->width = 1;
+    for (size_t k = 0; k < count; k++)
+    {
+        name_p name = (name_p) array_child(known, k);
+        const char *data = name_data(name);
+        size_t length = name_length(name);
+        for (size_t i = 0; i < length; i++)
+        {
+            uint8_t byte = data[i];
+            if (!ops->columns[byte])
+                ops->columns[byte] = ops->width++;
+        }
+        states += length;
+    }
+
+    // Allocate for the worst case, where operators share no prefix
+    assert(states <= UINT16_MAX && "Too many operators in syntax");
+    ops->next = calloc(states * ops->width, sizeof(uint16_t));
+    ops->states = calloc(states, sizeof(syntax_state_t));
+    ops->count = SYNTAX_OPERATOR_START + 1;
+
+    // Insert each known operator in the trie
+    for (size_t k = 0; k < count; k++)
+    {
+        name_p name = (name_p) array_child(known, k);
+        const char *data = name_data(name);
+        size_t length = name_length(name);
+        unsigned state = SYNTAX_OPERATOR_START;
+        for (size_t i = 0; i < length; i++)
+        {
+            uint16_t *next = &ops->next[state * ops->width +
+                                        ops->columns[(uint8_t) data[i]]];
+            if (!*next)
+                *next = ops->count++;
+            state = *next;
+        }
+        ops->states[state].name = name;
+    }
+
+    // Record the closing for block openings that are operators
+    array_p blocks = syntax->blocks;
+    size_t  pairs  = array_length(blocks) / 2;
+    for (size_t b = 0; b < pairs; b++)
+    {
+        name_p opening = (name_p) array_child(blocks, 2 * b);
+        unsigned state = syntax_operators_walk(ops, opening);
+        if (state && ops->states[state].name)
+            ops->states[state].closing = (name_p) array_child(blocks, 2*b+1);
+    }
+
+    syntax_operators_delete(syntax->operators);
+    syntax->operators = ops;
+}
+
+
 static inline void sort(array_p array, size_t stride)
 // ----------------------------------------------------------------------------
 //   Sort priority array
@@ -233,24 +344,23 @@ void syntax_read_internal(syntax_p syntax, scanner_p scanner, bool indented)
 
         case tokCHARACTER:
         case tokSYMBOL:
-            text_set(&source, scanner->source);
+            text_set(&source, scanner_source(scanner));
             name_set(&scanner->scanned.name,
-                     name_new(text_position(source),
-                              text_length(source) - 2 * offset,
-                              text_data(source) + offset));
+                     name_intern(text_length(source) - 2 * offset,
+                                 text_data(source) + offset));
             name_set(&known_token, scanner->scanned.name);
             /* Fall through */
 
         case tokNAME:
             name_set(&name, scanner->scanned.name);
-            text_set(&source, scanner->source);
+            text_set(&source, scanner_source(scanner));
 
             if (eq(source, "NEWLINE"))
-                set(&name, "\n");
+                name_set(&name, syntax_newline);
             else if (eq(source, "INDENT"))
-                set(&name, SYNTAX_INDENT);
+                name_set(&name, syntax_indent);
             else if (eq(source, "UNINDENT"))
-                set(&name, SYNTAX_UNINDENT);
+                name_set(&name, syntax_unindent);
 
             if (eq(source, "INFIX"))
                 state = INFIX;
@@ -370,6 +480,9 @@ void syntax_read_internal(syntax_p syntax, scanner_p scanner, bool indented)
 
     sort(syntax->syntaxes, 3);
 
+    // Rebuild the operator automaton with any new entries
+    syntax_compile(syntax);
+
     name_dispose(&entry);
 }
 
@@ -416,6 +529,44 @@ static inline int search(array_p array, name_p key, size_t stride)
 }
 
 
+static inline int search_data(array_p array,
+                              size_t length, const char *data, size_t stride)
+// ----------------------------------------------------------------------------
+//   Binary search on array for a name given by its spelling
+// ----------------------------------------------------------------------------
+//   This follows array_search and name_compare, and returns the same index,
+//   but does not require a name to be allocated for the key
+{
+    tree_p *items = array_data(array);
+    size_t  first = 0;
+    size_t  last  = array_length(array) / stride;
+    size_t  mid   = (first + last) / 2;
+
+    while (first < last)
+    {
+        name_p  key  = (name_p) items[mid * stride];
+        size_t  klen = name_length(key);
+        size_t  len  = length < klen ? length : klen;
+        int     cmp  = memcmp(data, name_data(key), len);
+        if (cmp == 0)
+            cmp = length < klen ? -1 : length > klen ? 1 : 0;
+        if (cmp == 0)
+            return mid;
+        size_t old = mid;
+        if (cmp > 0)
+            first = mid;
+        else
+            last = mid;
+        mid = (first + last) / 2;
+        if (mid == old)
+            break;
+    }
+
+    // Not found - Return closest location
+    return ~mid;
+}
+
+
 int syntax_infix_priority(syntax_p s, name_p name)
 // ----------------------------------------------------------------------------
 //    Return the priority for the given infix, or default_priority
@@ -469,7 +620,16 @@ bool syntax_is_operator(syntax_p s, name_p name)
 //   Check if the given name is a known operator
 // ----------------------------------------------------------------------------
 {
-    int where = search(s->known, name, 1);
+    return syntax_is_operator_data(s, name_length(name), name_data(name));
+}
+
+
+bool syntax_is_operator_data(syntax_p s, size_t length, const char *data)
+// ----------------------------------------------------------------------------
+//   Check if the given spelling is a known operator or the start of one
+// ----------------------------------------------------------------------------
+{
+    int where = search_data(s->known, length, data, 1);
 
     // Check if we had an exact match
     if (where >= 0)
@@ -478,15 +638,15 @@ bool syntax_is_operator(syntax_p s, name_p name)
     // Check if we had a partial match
     // If there were an entry like AACD, ABCD, ABCE and we searched ABC,
     // The mid point where we stopped can be AACD or ABCD
-    size_t length = array_length(s->known);
+    size_t known = array_length(s->known);
     size_t closest = ~where;
     for (size_t index = closest; index <= closest+1; index++)
     {
-        if (index < length)
+        if (index < known)
         {
             name_p key = (name_p) array_child(s->known, index);
-            if (name_length(name) < name_length(key) &&
-                memcmp(name_data(name), name_data(key), name_length(name)) == 0)
+            if (length < name_length(key) &&
+                memcmp(data, name_data(key), length) == 0)
                 return true;
         }
     }
@@ -500,7 +660,17 @@ bool syntax_is_block(syntax_p s, name_p name, name_p *closing)
 //    Check if the given name opens a block
 // ----------------------------------------------------------------------------
 {
-    int index = search(s->blocks, name, 2);
+    return syntax_is_block_data(s, name_length(name), name_data(name), closing);
+}
+
+
+bool syntax_is_block_data(syntax_p s, size_t length, const char *data,
+                          name_p *closing)
+// ----------------------------------------------------------------------------
+//    Check if the given spelling opens a block
+// ----------------------------------------------------------------------------
+{
+    int index = search_data(s->blocks, length, data, 2);
     if (index >= 0)
     {
         name_set(closing, (name_p) array_child(s->blocks, 2*index+1));
@@ -553,3 +723,80 @@ syntax_p syntax_is_special(syntax_p s, name_p name, name_p *closing)
     }
     return NULL;
 }
+
+
+
+// ============================================================================
+//
+//   Identifying a syntax
+//
+// ============================================================================
+
+static uint64_t syntax_hash_data(uint64_t hash, size_t size, const char *data)
+// ----------------------------------------------------------------------------
+//   FNV-1a hash of some bytes, continuing from the given hash
+// ----------------------------------------------------------------------------
+{
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ (uint8_t) data[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+
+static uint64_t syntax_hash_array(uint64_t hash, array_p array)
+// ----------------------------------------------------------------------------
+//   Hash the names, priorities and child syntaxes in a syntax array
+// ----------------------------------------------------------------------------
+{
+    size_t length = array_length(array);
+    hash = syntax_hash_data(hash, sizeof(length), (const char *) &length);
+    for (size_t i = 0; i < length; i++)
+    {
+        tree_p child = array_child(array, i);
+        if (tree_cast(name, child))
+        {
+            name_p name = (name_p) child;
+            size_t size = name_length(name);
+            hash = syntax_hash_data(hash, sizeof(size), (const char *) &size);
+            hash = syntax_hash_data(hash, size, name_data(name));
+        }
+        else if (tree_cast(natural, child))
+        {
+            unsigned long long priority = natural_value((natural_p) child);
+            hash = syntax_hash_data(hash, sizeof(priority),
+                                    (const char *) &priority);
+        }
+        else if (tree_cast(syntax, child))
+        {
+            uint64_t syntax = syntax_hash((syntax_p) child);
+            hash = syntax_hash_data(hash, sizeof(syntax),
+                                    (const char *) &syntax);
+        }
+    }
+    return hash;
+}
+
+
+uint64_t syntax_hash(syntax_p s)
+// ----------------------------------------------------------------------------
+//   Return a hash identifying how the syntax scans and parses input
+// ----------------------------------------------------------------------------
+//   Two syntaxes with the same hash have the same operators, priorities
+//   and delimiters, so that they produce the same tokens for an input.
+{
+    int      priorities[3] = { s->default_priority,
+                               s->statement_priority,
+                               s->function_priority };
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = syntax_hash_data(hash, sizeof(priorities),
+                            (const char *) priorities);
+    hash = syntax_hash_array(hash, s->known);
+    hash = syntax_hash_array(hash, s->infixes);
+    hash = syntax_hash_array(hash, s->prefixes);
+    hash = syntax_hash_array(hash, s->postfixes);
+    hash = syntax_hash_array(hash, s->comments);
+    hash = syntax_hash_array(hash, s->texts);
+    hash = syntax_hash_array(hash, s->blocks);
+    hash = syntax_hash_array(hash, s->syntaxes);
+    return hash;
+}
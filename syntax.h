@@ -34,6 +34,35 @@ tree_type(syntax);
 
 #undef inline
 
+
+typedef struct syntax_state
+// ----------------------------------------------------------------------------
+//   A state in the operator automaton, i.e. a prefix of known operators
+// ----------------------------------------------------------------------------
+{
+    name_p              name;           // Known operator ending here, if any
+    name_p              closing;        // Closing if it opens a block
+} syntax_state_t, *syntax_state_p;
+
+
+typedef struct syntax_operators
+// ----------------------------------------------------------------------------
+//   Automaton recognizing known operators one byte at a time
+// ----------------------------------------------------------------------------
+//   Bytes that appear in operators are mapped to columns, starting at 1.
+//   The transitions are a table with one row per state and one entry
+//   per column. State 0 is the dead state, state 1 the initial state.
+{
+    uint8_t             columns[256];   // Column for each byte, 0 if none
+    unsigned            width;          // Number of columns in a row
+    unsigned            count;          // Number of states
+    uint16_t *          next;           // Transitions, count rows of width
+    syntax_state_p      states;         // Information about each state
+} syntax_operators_t, *syntax_operators_p;
+
+#define SYNTAX_OPERATOR_START   1
+
+
 typedef struct syntax
 // ----------------------------------------------------------------------------
 //   Internal description of the syntax configuration in xl.syntax
@@ -60,6 +89,9 @@ typedef struct syntax
     // Delimiters for child syntax, and the table itself
     array_p             syntaxes;
 
+    // Automaton for known operators, built from the arrays above
+    syntax_operators_p  operators;
+
     // Priorities
     int                 default_priority;
     int                 statement_priority;
@@ -81,13 +113,68 @@ extern int      syntax_infix_priority(syntax_p, name_p name);
 extern int      syntax_prefix_priority(syntax_p, name_p name);
 extern int      syntax_postfix_priority(syntax_p, name_p name);
 extern bool     syntax_is_operator(syntax_p, name_p name);
+extern bool     syntax_is_operator_data(syntax_p, size_t, const char *data);
 extern bool     syntax_is_block(syntax_p, name_p name, name_p *closing);
+extern bool     syntax_is_block_data(syntax_p, size_t, const char *data,
+                                     name_p *closing);
 extern bool     syntax_is_text(syntax_p, name_p name, name_p *closing);
 extern bool     syntax_is_comment(syntax_p, name_p name, name_p *closing);
 extern syntax_p syntax_is_special(syntax_p, name_p name, name_p *closing);
 
+// Identifying a syntax, e.g. to cache tokens scanned with it
+extern uint64_t syntax_hash(syntax_p);
+
+// Walking the operator automaton
+#ifdef SYNTAX_C
+#define inline extern inline
+#endif // SYNTAX_C
+
+inline unsigned syntax_operator_next(syntax_p, unsigned state, int c);
+inline name_p   syntax_operator_name(syntax_p, unsigned state);
+inline name_p   syntax_operator_closing(syntax_p, unsigned state);
+
+#undef inline
+
 // Internal representation of block indent and unindent
 #define SYNTAX_INDENT    "\t"
 #define SYNTAX_UNINDENT  "\b"
 
+
+
+// ============================================================================
+//
+//   Inline implementations
+//
+// ============================================================================
+
+inline unsigned syntax_operator_next(syntax_p s, unsigned state, int c)
+// ----------------------------------------------------------------------------
+//   Return the state after reading c, or 0 if no operator continues with c
+// ----------------------------------------------------------------------------
+{
+    syntax_operators_p ops = s->operators;
+    unsigned column = ops ? ops->columns[(uint8_t) c] : 0;
+    if (!column)
+        return 0;
+    return ops->next[state * ops->width + column];
+}
+
+
+inline name_p syntax_operator_name(syntax_p s, unsigned state)
+// ----------------------------------------------------------------------------
+//   Return the known operator ending at the given state, or NULL
+// ----------------------------------------------------------------------------
+{
+    return s->operators->states[state].name;
+}
+
+
+inline name_p syntax_operator_closing(syntax_p s, unsigned state)
+// ----------------------------------------------------------------------------
+//   Return the block closing if the state is a block opening, or NULL
+// ----------------------------------------------------------------------------
+{
+    return s->operators->states[state].closing;
+}
+
 #endif // SYNTAX_H
@@ -122,7 +122,7 @@ extern text_p text_vprintf(srcpos_t pos, const char *format, va_list va)
 
         // Move the text following %t up
         char *data = (char *) text_data(result);
-        unsigned mov_size = new_size - offset - 2;
+        unsigned mov_size = old_size - offset - 2;
         memmove(data + offset + ins_size, data + offset + 2, mov_size);
 
         // Copy the insertion text in the middle
@@ -50,6 +50,7 @@ extern tree_p text_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 
 // Helper macro to initialize with a C constant
 #define text_cnew(pos, text)    text_new(pos, strlen(text), text)
+#define text_static(var, str)   blob_static(text, var, str)
 
 
 #undef inline
@@ -21,6 +21,7 @@
 #define TREE_C
 #include "tree.h"
 
+#include "config.h"
 #include "error.h"
 #include "recorder.h"
 #include "renderer.h"
@@ -30,6 +31,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined(NDEBUG) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#endif
+
 
 RECORDER(ALLOC, 128, "Tree allocations");
 
@@ -50,6 +55,16 @@ typedef struct tree_debug
 static tree_debug_p trees = NULL, trees_end = NULL;
 static unsigned allocs = 0;
 
+// The list is shared by threads that allocate trees, e.g. when scanning
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t trees_lock = PTHREAD_MUTEX_INITIALIZER;
+#define TREES_LOCK()    pthread_mutex_lock(&trees_lock)
+#define TREES_UNLOCK()  pthread_mutex_unlock(&trees_lock)
+#else // !HAVE_LIBPTHREAD
+#define TREES_LOCK()
+#define TREES_UNLOCK()
+#endif // HAVE_LIBPTHREAD
+
 
 unsigned tree_debug_index = ~0U;
 
@@ -64,10 +79,82 @@ void tree_debug(tree_debug_p debug, tree_p tree)
 #endif
 
 
+// ============================================================================
+//
+//    Memory budget
+//
+// ============================================================================
+
+tree_thread_local tree_budget_p tree_current_budget = NULL;
+
+
+tree_budget_p tree_budget(void)
+// ----------------------------------------------------------------------------
+//   Return the budget currently charged in this thread
+// ----------------------------------------------------------------------------
+{
+    return tree_current_budget;
+}
+
+
+tree_budget_p tree_set_budget(tree_budget_p budget)
+// ----------------------------------------------------------------------------
+//   Select the budget charged by tree allocations, return the previous one
+// ----------------------------------------------------------------------------
+{
+    tree_budget_p old = tree_current_budget;
+    tree_current_budget = budget;
+    return old;
+}
+
+
+static inline void tree_budget_charge(size_t allocated, size_t freed)
+// ----------------------------------------------------------------------------
+//   Update the current budget after an allocation or deallocation
+// ----------------------------------------------------------------------------
+//   Trees may have been allocated before the budget was installed,
+//   so the amount used is clamped at 0 when freeing them.
+{
+    tree_budget_p budget = tree_current_budget;
+    if (!budget)
+        return;
+    if (allocated)
+        budget->allocations++;
+    budget->used += allocated;
+    budget->used = budget->used > freed ? budget->used - freed : 0;
+    if (budget->limit && budget->used > budget->limit && !budget->exceeded)
+    {
+        budget->exceeded = true;
+        RECORD(ALLOC, "Budget %p exceeded, used %zu, limit %zu",
+               budget, budget->used, budget->limit);
+    }
+}
+
+
+
+// ============================================================================
+//
+//    Allocation primitives
+//
+// ============================================================================
+
 tree_p tree_malloc_(const char *source, size_t size)
 // ----------------------------------------------------------------------------
 //   Allocate a tree, clear refcount and insert in global list
 // ----------------------------------------------------------------------------
+{
+    tree_p result = tree_malloc_raw_(source, size);
+    memset(result, 0, size);
+    return result;
+}
+
+
+tree_p tree_malloc_raw_(const char *source, size_t size)
+// ----------------------------------------------------------------------------
+//   Allocate a tree without clearing it, and insert it in global list
+// ----------------------------------------------------------------------------
+//   This is for trees that are not all written immediately, e.g. lazy
+//   blobs, so that large allocations do not touch memory until needed.
 {
 #ifdef NDEBUG
     tree_p result = malloc(size);
@@ -76,21 +163,23 @@ tree_p tree_malloc_(const char *source, size_t size)
     tree_p result = (tree_p) (debug + 1);
 
     debug->source = source;
-    debug->alloc = allocs++;
     debug->next = NULL;
+    TREES_LOCK();
+    debug->alloc = allocs++;
     debug->previous = trees_end;
     if (trees_end)
         trees_end->next = debug;
     else
         trees = debug;
     trees_end = debug;
+    TREES_UNLOCK();
 
     if (debug->alloc == tree_debug_index)
         tree_debug(debug, result);
 #endif // NDEBUG
 
     RECORD(ALLOC, "%s: malloc(%zu)=%p", source, size, result);
-    memset(result, 0, size);
+    tree_budget_charge(size, 0);
 
     return result;
 }
@@ -105,10 +194,13 @@ tree_p tree_realloc_(const char *source, tree_p old, size_t new_size)
         return tree_malloc(new_size);
 
     assert(old->refcount <= 1 && "Do not create dangling pointers to tree");
+    if (tree_current_budget)
+        tree_budget_charge(new_size, tree_size(old));
 
 #ifdef NDEBUG
     tree_p result = realloc(old, new_size);
 #else
+    TREES_LOCK();
     tree_debug_p old_dbg = (tree_debug_p) old - 1;
     tree_debug_p previous = old_dbg->previous;
     tree_debug_p next = old_dbg->next;
@@ -127,6 +219,7 @@ tree_p tree_realloc_(const char *source, tree_p old, size_t new_size)
         else
             trees = debug;
     }
+    TREES_UNLOCK();
     debug->source = source;
 
     if (debug->alloc == tree_debug_index)
@@ -162,13 +255,16 @@ void tree_free_(const char *source, tree_p tree)
 {
     assert(tree->refcount == 0 && "Only non-referenced trees can be freed");
     RECORD(ALLOC, "%s: free(%p) refcount %u", source, tree, tree->refcount);
+    if (tree_current_budget)
+        tree_budget_charge(0, tree_size(tree));
 #ifndef NDEBUG
     tree_debug_p debug = (tree_debug_p) tree - 1;
-    tree_debug_p previous = debug->previous;
-    tree_debug_p next = debug->next;
     if (debug->alloc == tree_debug_index)
         tree_debug(debug, tree);
 
+    TREES_LOCK();
+    tree_debug_p previous = debug->previous;
+    tree_debug_p next = debug->next;
     if (previous)
         previous->next = next;
     else
@@ -177,6 +273,7 @@ void tree_free_(const char *source, tree_p tree)
         next->previous = previous;
     else
         trees_end = previous;
+    TREES_UNLOCK();
     tree->handler = tree_double_free;
     tree->position = (srcpos_t) source;
     free(debug);
@@ -200,8 +297,10 @@ unsigned tree_memcheck(unsigned expected_tree_count)
     bool bad = false;
     for (tree_debug_p debug = trees; debug; debug = debug->next)
     {
-        index++;
         tree_p tree = (tree_p) (debug + 1);
+        if (tree->refcount == TREE_IMMORTAL)
+            continue;
+        index++;
         if ((int) tree->refcount <= 0)
         {
             fprintf(stderr,
@@ -227,6 +326,8 @@ unsigned tree_memcheck(unsigned expected_tree_count)
         for (tree_debug_p debug = trees; debug; debug = debug->next)
         {
             tree_p tree = (tree_p) (debug + 1);
+            if (tree->refcount == TREE_IMMORTAL)
+                continue;
             fprintf(stderr, "Leaked tree index %u addr %p refcount %d\n",
                     debug->alloc, tree, (int) tree->refcount);
             tree_print(stderr, tree);
@@ -341,6 +442,57 @@ void tree_print(FILE *stream, tree_p tree)
 }
 
 
+typedef struct tree_delete_list
+// ----------------------------------------------------------------------------
+//   Trees whose deletion was deferred while deleting their parent
+// ----------------------------------------------------------------------------
+{
+    tree_p *    trees;
+    size_t      count;
+    size_t      size;
+    bool        active;
+} tree_delete_list_t;
+
+static tree_thread_local tree_delete_list_t tree_deleting = { 0 };
+
+
+static void tree_delete_children(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Release the children of a tree, deleting them without recursion
+// ----------------------------------------------------------------------------
+//   Children that are no longer referenced are queued, and only the
+//   outermost deletion in a thread deletes them, so that the stack depth
+//   does not depend on the depth of the tree being deleted.
+{
+    tree_delete_list_t *list = &tree_deleting;
+    size_t arity = tree_arity(tree);
+    tree_p *children = tree_children(tree);
+    for (size_t c = 0; c < arity; c++)
+    {
+        tree_p child = children[c];
+        children[c] = NULL;
+        if (!child || (child->refcount && tree_unref(child)))
+            continue;
+        if (list->count == list->size)
+        {
+            list->size = list->size ? 2 * list->size : 64;
+            list->trees = realloc(list->trees, list->size * sizeof(tree_p));
+        }
+        list->trees[list->count++] = child;
+    }
+
+    if (list->active)
+        return;
+    list->active = true;
+    while (list->count)
+        tree_delete(list->trees[--list->count]);
+    list->active = false;
+    free(list->trees);
+    list->trees = NULL;
+    list->size = 0;
+}
+
+
 tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 // ----------------------------------------------------------------------------
 //   The default type handler for base trees
@@ -385,7 +537,7 @@ tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 
     case TREE_DELETE:
         // Check if the tree has a non-zero arity. If so, unref children
-        tree_children_loop(tree, tree_dispose(child));
+        tree_delete_children(tree);
 
         // Free the memory associated with the tree
         assert(tree->refcount == 0 && "Cannot free tree if still referenced");
@@ -432,6 +584,185 @@ tree_p tree_handler(tree_cmd_t cmd, tree_p tree, va_list va)
 }
 
 
+// ============================================================================
+//
+//    Tree compaction
+//
+// ============================================================================
+
+typedef union tree_align
+// ----------------------------------------------------------------------------
+//   The most constrained alignment for data found in trees
+// ----------------------------------------------------------------------------
+{
+    void *              pointer;
+    double              real;
+    long long           integer;
+} tree_align_t;
+
+
+typedef struct tree_compact_map
+// ----------------------------------------------------------------------------
+//   Map from original trees to their offset in the compacted region
+// ----------------------------------------------------------------------------
+{
+    tree_p *            trees;          // Original trees, depth-first order
+    size_t *            offsets;        // Offset of each tree in region
+    size_t              count;          // Number of trees recorded
+    size_t              allocated;      // Allocated entries in trees/offsets
+    size_t *            index;          // Hash table of index + 1, 0 if free
+    size_t              mask;           // Size of hash table - 1
+} tree_compact_map_t, *tree_compact_map_p;
+
+
+static inline size_t tree_compact_hash(tree_compact_map_p map, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Hash a tree pointer for the compaction map
+// ----------------------------------------------------------------------------
+{
+    uintptr_t key = (uintptr_t) tree / sizeof(tree_align_t);
+    return (key * 2654435761u) & map->mask;
+}
+
+
+static size_t tree_compact_find(tree_compact_map_p map, tree_p tree)
+// ----------------------------------------------------------------------------
+//   Return the index + 1 of the tree in the map, or 0 if not found
+// ----------------------------------------------------------------------------
+{
+    for (size_t h = tree_compact_hash(map, tree); ; h = (h + 1) & map->mask)
+    {
+        size_t entry = map->index[h];
+        if (entry == 0 || map->trees[entry - 1] == tree)
+            return entry;
+    }
+}
+
+
+static void tree_compact_insert(tree_compact_map_p map,
+                                tree_p tree, size_t offset)
+// ----------------------------------------------------------------------------
+//   Record a tree at the given offset, growing the map as needed
+// ----------------------------------------------------------------------------
+{
+    if (map->count == map->allocated)
+    {
+        map->allocated = map->allocated ? 2 * map->allocated : 64;
+        map->trees = realloc(map->trees, map->allocated * sizeof(tree_p));
+        map->offsets = realloc(map->offsets, map->allocated * sizeof(size_t));
+    }
+    map->trees[map->count] = tree;
+    map->offsets[map->count] = offset;
+    map->count++;
+
+    // Keep the hash table at most half full
+    if (2 * map->count > map->mask + 1)
+    {
+        free(map->index);
+        map->mask = 2 * (map->mask + 1) - 1;
+        map->index = calloc(map->mask + 1, sizeof(size_t));
+        for (size_t i = 0; i < map->count; i++)
+        {
+            size_t h = tree_compact_hash(map, map->trees[i]);
+            while (map->index[h])
+                h = (h + 1) & map->mask;
+            map->index[h] = i + 1;
+        }
+    }
+    else
+    {
+        size_t h = tree_compact_hash(map, tree);
+        while (map->index[h])
+            h = (h + 1) & map->mask;
+        map->index[h] = map->count;
+    }
+}
+
+
+void tree_compact(tree_p *ptr)
+// ----------------------------------------------------------------------------
+//   Relocate a finished tree into a single region, in depth-first order
+// ----------------------------------------------------------------------------
+//   All counted trees reachable from the root are copied in one allocation,
+//   the root first, so that traversals stream through memory sequentially.
+//   Shared or immortal trees are left where they are, since they are not
+//   counted. Copies other than the root are made immortal, so that only the
+//   root holds the region, and freeing the root frees all of it.
+//   The compacted tree must be treated as read-only: nodes can no longer
+//   be individually released, resized or modified in place.
+{
+    tree_p root = *ptr;
+    if (!root || root->refcount >= TREE_SHARED)
+        return;
+
+    tree_compact_map_t map = { 0 };
+    map.mask = 63;
+    map.index = calloc(map.mask + 1, sizeof(size_t));
+
+    // First pass: record trees in depth-first order and compute offsets
+    size_t   total = 0;
+    size_t   depth = 1;
+    size_t   max_depth = 64;
+    tree_p  *stack = malloc(max_depth * sizeof(tree_p));
+    stack[0] = root;
+    while (depth)
+    {
+        tree_p tree = stack[--depth];
+        if (!tree || tree->refcount >= TREE_SHARED)
+            continue;
+        if (tree_compact_find(&map, tree))
+            continue;
+
+        size_t size = tree_size(tree);
+        size_t align = sizeof(tree_align_t);
+        tree_compact_insert(&map, tree, total);
+        total += (size + align - 1) / align * align;
+
+        // Push children in reverse order, so that the first one comes next
+        size_t arity = tree_arity(tree);
+        tree_p *children = tree_children(tree);
+        if (depth + arity > max_depth)
+        {
+            while (depth + arity > max_depth)
+                max_depth *= 2;
+            stack = realloc(stack, max_depth * sizeof(tree_p));
+        }
+        while (arity--)
+            stack[depth++] = children[arity];
+    }
+    free(stack);
+
+    // Second pass: copy trees and redirect children to the copies
+    char *region = (char *) tree_malloc(total);
+    for (size_t i = 0; i < map.count; i++)
+    {
+        tree_p original = map.trees[i];
+        tree_p copy = (tree_p) (region + map.offsets[i]);
+        memcpy(copy, original, tree_size(original));
+        copy->refcount = i ? TREE_IMMORTAL : 0;
+
+        size_t arity = tree_arity(copy);
+        tree_p *children = tree_children(copy);
+        for (size_t c = 0; c < arity; c++)
+        {
+            tree_p child = children[c];
+            size_t entry = child ? tree_compact_find(&map, child) : 0;
+            if (entry)
+                children[c] = (tree_p) (region + map.offsets[entry - 1]);
+        }
+    }
+    RECORD(ALLOC, "Compacted %p into %p, %zu trees, %zu bytes",
+           root, region, map.count, total);
+
+    free(map.trees);
+    free(map.offsets);
+    free(map.index);
+
+    // Replace the original tree, releasing it if we held the last reference
+    tree_set(ptr, (tree_p) region);
+}
+
+
 const char *tree_cmd_name(tree_cmd_t cmd)
 // ----------------------------------------------------------------------------
 //   Return the name associated with a tree cmd
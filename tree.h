@@ -96,6 +96,12 @@ typedef uintptr_t srcpos_t;
 // Reference counting
 typedef uintptr_t refcnt_t;
 
+// Reference counts at or above this value are not counted (see epoch.h)
+#define TREE_SHARED     ((refcnt_t) 1 << (8 * sizeof(refcnt_t) - 1))
+
+// Immortal trees are never counted nor freed, e.g. static constants
+#define TREE_IMMORTAL   ((refcnt_t) -1)
+
 
 typedef struct tree
 // ----------------------------------------------------------------------------
@@ -107,6 +113,21 @@ typedef struct tree
     srcpos_t            position;     // Source code position
 } tree_t, *tree_p;
 
+
+typedef struct tree_budget
+// ----------------------------------------------------------------------------
+//   Memory budget charged for tree allocations in the current thread
+// ----------------------------------------------------------------------------
+//   Allocations still succeed once the limit is exceeded, since callers
+//   do not expect failures. Long-running loops (e.g. in the scanner or
+//   parser) check tree_budget_exceeded to stop cleanly instead.
+{
+    size_t              limit;        // Maximum number of bytes, 0 if none
+    size_t              used;         // Bytes currently charged
+    size_t              allocations;  // Number of allocations charged
+    bool                exceeded;     // An allocation went over the limit
+} tree_budget_t, *tree_budget_p;
+
 #ifdef TREE_C
 #define inline extern inline
 #endif // TREE_C
@@ -117,6 +138,7 @@ inline void        tree_delete(tree_p tree);
 inline refcnt_t    tree_refcount(tree_p tree);
 inline refcnt_t    tree_ref(tree_p tree);
 inline refcnt_t    tree_unref(tree_p tree);
+inline tree_p      tree_immortal(tree_p tree);
 inline tree_p      tree_use(tree_p tree);
 inline void        tree_set(tree_p *ptr, tree_p tree);
 inline void        tree_dispose(tree_p *tree);
@@ -129,6 +151,7 @@ inline tree_p      tree_child(tree_p tree, unsigned index);
 inline tree_p      tree_set_child(tree_p tree, unsigned index, tree_p child);
 inline tree_p      tree_copy(tree_p tree);
 inline tree_p      tree_clone(tree_p tree);
+extern void        tree_compact(tree_p *tree);
 extern text_p      tree_text(tree_p tree);
 extern void        tree_print(FILE *stream, tree_p tree);
 extern void        tree_render(tree_p tree, renderer_p renderer);
@@ -143,10 +166,15 @@ extern tree_p   tree_handler(tree_cmd_t cmd, tree_p tree, va_list va);
 extern tree_p   tree_make(tree_handler_fn handler, srcpos_t position, ...);
 extern unsigned tree_memcheck(unsigned tree_count);
 extern tree_p   tree_malloc_(const char *where, size_t size);
+extern tree_p   tree_malloc_raw_(const char *where, size_t size);
 extern tree_p   tree_realloc_(const char *where, tree_p old, size_t new_size);
 extern void     tree_free_(const char *where, tree_p tree);
+extern tree_budget_p tree_budget(void);
+extern tree_budget_p tree_set_budget(tree_budget_p budget);
+inline bool     tree_budget_exceeded(void);
 inline tree_handler_fn          tree_cast_handler(va_list va);
 #define tree_malloc(sz)         tree_malloc_(SOURCE, (sz))
+#define tree_malloc_raw(sz)     tree_malloc_raw_(SOURCE, (sz))
 #define tree_realloc(old, sz)   tree_realloc_(SOURCE, (old), (sz))
 #define tree_free(t)            tree_free_(SOURCE, (t))
 #define tree_cast(type, tree)   ((type##_p) tree_cast_(tree, type##_handler))
@@ -210,15 +238,31 @@ inline void tree_delete(tree_p tree)
     __atomic_compare_exchange_n(&Value, &Expected, New,                 \
                                 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
 
+#define tree_thread_local       __thread
+
 #else // ! __GNUC__
 
 #warning "Compiler not supported yet - Not thread safe"
 #define tree_fetch_add(Value, OFfset)   (Value += Offset)
 #define tree_add_fetch(Value, Offset)   ((Value += Offset), Value)
 #define tree_compare_exchange(Value, Expected, New)   ((Value = New), true)
+#define tree_thread_local
 
 #endif
 
+// Budget currently charged for tree allocations, see tree_set_budget
+extern tree_thread_local tree_budget_p tree_current_budget;
+
+
+inline bool tree_budget_exceeded(void)
+// ----------------------------------------------------------------------------
+//   Check if the current memory budget was exceeded
+// ----------------------------------------------------------------------------
+{
+    tree_budget_p budget = tree_current_budget;
+    return budget && budget->exceeded;
+}
+
 
 inline refcnt_t tree_refcount(tree_p tree)
 // ----------------------------------------------------------------------------
@@ -233,7 +277,10 @@ inline refcnt_t tree_ref(tree_p tree)
 // ----------------------------------------------------------------------------
 //   Increment reference count of the tree
 // ----------------------------------------------------------------------------
+//   Shared and immortal trees are not counted, to avoid atomic operations
 {
+    if (tree->refcount >= TREE_SHARED)
+        return tree->refcount;
     assert(tree->refcount + 1 != 0 && "Suspiciously too many references");
     return tree_fetch_add(tree->refcount, 1);
 }
@@ -244,12 +291,25 @@ inline refcnt_t tree_unref(tree_p tree)
 //   Decrement reference count of the tree
 // ----------------------------------------------------------------------------
 {
+    if (tree->refcount >= TREE_SHARED)
+        return tree->refcount;
     assert(tree->refcount && "Cannot unref if never referenced");
     refcnt_t count = tree_add_fetch(tree->refcount, -1);
     return count;
 }
 
 
+inline tree_p tree_immortal(tree_p tree)
+// ----------------------------------------------------------------------------
+//   Make a tree immortal, i.e. no longer reference counted
+// ----------------------------------------------------------------------------
+//   This must be done before the tree is visible to other threads
+{
+    tree->refcount = TREE_IMMORTAL;
+    return tree;
+}
+
+
 inline void tree_dispose(tree_p *tree)
 // ----------------------------------------------------------------------------
 //   Check if tree can be freed, and if so, delete it
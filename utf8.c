@@ -4,7 +4,7 @@
 //
 //   File Description:
 //
-//
+//     Validating and counting UTF-8 text
 //
 //
 //
@@ -21,3 +21,313 @@
 
 #define UTF8_C
 #include "utf8.h"
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+
+// ============================================================================
+//
+//    Validation
+//
+// ============================================================================
+//   Valid sequences follow RFC 3629: no overlong encodings, no surrogates,
+//   nothing above U+10FFFF. Blocks of 16 bytes are checked at once with the
+//   lookup tables of the simdutf / simdjson validator (Keiser and Lemire),
+//   and bytes are checked one at a time at the edges of the input or of a
+//   block that has errors, in order to find the first invalid sequence.
+
+static inline bool utf8_step(utf8_state_p state, uint8_t c)
+// ----------------------------------------------------------------------------
+//   Check one more byte of input, return false if it is invalid
+// ----------------------------------------------------------------------------
+{
+    if (state->needed)
+    {
+        if (c < state->low || c > state->high)
+            return false;
+        state->low = 0x80;
+        state->high = 0xBF;
+        state->seen++;
+        if (--state->needed == 0)
+            state->seen = 0;
+        return true;
+    }
+
+    state->seen = 1;
+    state->low = 0x80;
+    state->high = 0xBF;
+    if (c < 0x80)
+    {
+        state->seen = 0;
+        return true;
+    }
+    if (c < 0xC2)
+    {
+        state->seen = 0;
+        return false;
+    }
+    if (c < 0xE0)
+    {
+        state->needed = 1;
+        return true;
+    }
+    if (c < 0xF0)
+    {
+        // E0 would be overlong below A0, ED would encode surrogates above 9F
+        state->needed = 2;
+        if (c == 0xE0)
+            state->low = 0xA0;
+        else if (c == 0xED)
+            state->high = 0x9F;
+        return true;
+    }
+    if (c < 0xF5)
+    {
+        // F0 would be overlong below 90, F4 would be above U+10FFFF after 8F
+        state->needed = 3;
+        if (c == 0xF0)
+            state->low = 0x90;
+        else if (c == 0xF4)
+            state->high = 0x8F;
+        return true;
+    }
+    state->seen = 0;
+    return false;
+}
+
+
+static size_t utf8_sequence_start(const uint8_t *data, size_t i)
+// ----------------------------------------------------------------------------
+//   Move back to the start of a sequence that is not complete before i
+// ----------------------------------------------------------------------------
+//   The input before i is known to be valid, so only the last three bytes
+//   can begin a sequence that continues at i.
+{
+    for (size_t back = 1; back <= 3 && back <= i; back++)
+    {
+        uint8_t c = data[i - back];
+        if (c < 0x80)
+            break;
+        if (c >= 0xC0)
+        {
+            size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+            return length > back ? i - back : i;
+        }
+    }
+    return i;
+}
+
+
+#ifdef __SSSE3__
+static inline __m128i utf8_lookup(const char table[16], __m128i index)
+// ----------------------------------------------------------------------------
+//   Look up a 16-entry table for each byte of index
+// ----------------------------------------------------------------------------
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) table), index);
+}
+
+
+static bool utf8_block_valid(const uint8_t *data)
+// ----------------------------------------------------------------------------
+//   Check 16 bytes, given that the three bytes before them are complete
+// ----------------------------------------------------------------------------
+//   Each byte is classified by the high nibble of the previous byte, the
+//   low nibble of the previous byte and its own high nibble. Each table
+//   entry is the set of errors that byte pair could be part of, and a pair
+//   is invalid if the three sets have an error in common. The only valid
+//   case flagged this way is a continuation after a continuation, which
+//   must be the third or fourth byte of a sequence.
+{
+    enum
+    {
+        TOO_SHORT       = 1 << 0,       // Lead byte not followed by 10xxxxxx
+        TOO_LONG        = 1 << 1,       // ASCII followed by 10xxxxxx
+        OVERLONG_3      = 1 << 2,       // 11100000 100xxxxx
+        TOO_LARGE       = 1 << 3,       // 11110100 1001xxxx and above
+        SURROGATE       = 1 << 4,       // 11101101 101xxxxx
+        OVERLONG_2      = 1 << 5,       // 1100000x 10xxxxxx
+        TOO_LARGE_1000  = 1 << 6,       // 11110101 1000xxxx and above
+        OVERLONG_4      = 1 << 6,       // 11110000 1000xxxx
+        TWO_CONTS       = 1 << 7,       // 10xxxxxx 10xxxxxx
+        CARRY           = TOO_SHORT | TOO_LONG | TWO_CONTS
+    };
+    static const char byte_1_high[16] =
+    {
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        (char) (TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4)
+    };
+    static const char byte_1_low[16] =
+    {
+        (char) (CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+        (char) (CARRY | OVERLONG_2),
+        (char) CARRY,
+        (char) CARRY,
+        (char) (CARRY | TOO_LARGE),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+        (char) (CARRY | TOO_LARGE | TOO_LARGE_1000)
+    };
+    static const char byte_2_high[16] =
+    {
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 |
+                TOO_LARGE_1000 | OVERLONG_4),
+        (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),
+        (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+        (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+    };
+
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i input = _mm_loadu_si128((const __m128i *) data);
+    __m128i prev1 = _mm_loadu_si128((const __m128i *) (data - 1));
+    __m128i prev2 = _mm_loadu_si128((const __m128i *) (data - 2));
+    __m128i prev3 = _mm_loadu_si128((const __m128i *) (data - 3));
+
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(
+            utf8_lookup(byte_1_high,
+                        _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            utf8_lookup(byte_1_low, _mm_and_si128(prev1, nibble))),
+        utf8_lookup(byte_2_high,
+                    _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    // Third and fourth bytes of sequences must be continuations
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char) (0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char) (0xF0 - 0x80)));
+    __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth),
+                                          _mm_set1_epi8((char) 0x80));
+    __m128i errors = _mm_xor_si128(must_continue, special);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(errors,
+                                            _mm_setzero_si128())) == 0xFFFF;
+}
+#endif // __SSSE3__
+
+
+static size_t utf8_blocks(const uint8_t *data, size_t i, size_t length)
+// ----------------------------------------------------------------------------
+//   Check blocks of 16 bytes from i, return where checking should resume
+// ----------------------------------------------------------------------------
+//   The input before i must be valid and complete, with at least 3 bytes.
+//   This stops before a block with errors, or before a sequence that is
+//   not complete at the end of the checked blocks.
+{
+#if defined(__SSSE3__) || defined(__SSE2__)
+    size_t start = i;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i input = _mm_loadu_si128((const __m128i *) (data + i));
+        if (_mm_movemask_epi8(input) == 0)
+            continue;
+#ifdef __SSSE3__
+        if (utf8_block_valid(data + i))
+            continue;
+#endif // __SSSE3__
+        break;
+    }
+    if (i == start)
+        return i;
+#endif // __SSSE3__ || __SSE2__
+    return utf8_sequence_start(data, i);
+}
+
+
+size_t utf8_validate(utf8_state_p state, const char *text, size_t length)
+// ----------------------------------------------------------------------------
+//   Check that text is valid UTF-8, return the offset of the first error
+// ----------------------------------------------------------------------------
+//   This returns length if there is no error. A sequence that is not
+//   complete at the end of the text is recorded in the state, and checked
+//   with the text given in the next call. When there is an error, the seen
+//   field of the state indicates how many bytes of the invalid sequence
+//   were before the returned offset, possibly in a previous call.
+{
+    const uint8_t *data = (const uint8_t *) text;
+    size_t         i    = 0;
+
+    while (i < length)
+    {
+        // Check in blocks when the three bytes before are complete
+        if (!state->needed && i >= 3)
+        {
+            size_t next = utf8_blocks(data, i, length);
+            if (next > i)
+            {
+                i = next;
+                continue;
+            }
+        }
+
+        // Check one block a byte at a time, until sequences are complete
+        size_t last = i + 16 < length ? i + 16 : length;
+        for (; i < last || (state->needed && i < length); i++)
+        {
+            if (!utf8_step(state, data[i]))
+            {
+                state->needed = 0;
+                return i;
+            }
+        }
+    }
+    return length;
+}
+
+
+
+// ============================================================================
+//
+//    Counting code points
+//
+// ============================================================================
+
+size_t utf8_count(const char *text, size_t length)
+// ----------------------------------------------------------------------------
+//   Count the code points in text, i.e. the bytes that are not continuations
+// ----------------------------------------------------------------------------
+{
+    size_t count = 0;
+    size_t i     = 0;
+
+#if defined(__AVX2__)
+    const __m256i next = _mm256_set1_epi8((char) 0xBF);
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (text + i));
+        uint32_t first = _mm256_movemask_epi8(_mm256_cmpgt_epi8(bytes, next));
+        count += __builtin_popcount(first);
+    }
+#elif defined(__SSE2__)
+    const __m128i next = _mm_set1_epi8((char) 0xBF);
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (text + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(bytes,
+                                                                     next)));
+    }
+#endif // __AVX2__ / __SSE2__
+
+    // As signed bytes, continuations 80-BF are the only ones below -64
+    for (; i < length; i++)
+        count += (int8_t) text[i] > (int8_t) 0xBF;
+    return count;
+}
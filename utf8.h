@@ -23,6 +23,21 @@
 
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct utf8_state
+// ----------------------------------------------------------------------------
+//   State of UTF-8 validation for input that arrives in several pieces
+// ----------------------------------------------------------------------------
+{
+    uint8_t     needed;         // Continuation bytes still expected
+    uint8_t     seen;           // Bytes already read in current sequence
+    uint8_t     low;            // Lowest valid next continuation byte
+    uint8_t     high;           // Highest valid next continuation byte
+} utf8_state_t, *utf8_state_p;
+
 
 #ifdef UTF8_C
 #define inline extern inline
@@ -36,6 +51,9 @@ inline unsigned utf8_next(const char *text, unsigned position);
 inline unsigned utf8_code(const char *text, unsigned len);
 inline unsigned utf8_length(const char *text, unsigned len);
 
+extern size_t   utf8_validate(utf8_state_p state, const char *text, size_t len);
+extern size_t   utf8_count(const char *text, size_t len);
+
 #undef inline
 
 
@@ -74,7 +92,7 @@ inline unsigned utf8_previous(const char *text, unsigned position)
     if (position > 0)
     {
         position--;
-        while (position > 0 && utf8_is_next(text[position]))
+        while (position > 0 && utf8_is_next((uint8_t) text[position]))
             position--;
     }
     return position;
@@ -89,7 +107,7 @@ inline unsigned utf8_next(const char *text, unsigned position)
     if (text[position])
     {
         position++;
-        while (utf8_is_next(text[position]))
+        while (utf8_is_next((uint8_t) text[position]))
             position++;
     }
     return position;
@@ -105,11 +123,11 @@ inline unsigned utf8_code(const char *text, unsigned length)
     if (length == 0)
         return code;
 
-    code = text[0];
+    code = (uint8_t) text[0];
     if (length <= 1 || (code & 0x80) == 0)
         return code;
 
-    unsigned c1 = text[1];
+    unsigned c1 = (uint8_t) text[1];
     if (!utf8_is_next(c1))
         return code;
 
@@ -120,7 +138,7 @@ inline unsigned utf8_code(const char *text, unsigned length)
     if (length <= 2)
         return code;
 
-    unsigned c2 = text[2];
+    unsigned c2 = (uint8_t) text[2];
     if (!utf8_is_next(c2))
         return code;
 
@@ -132,12 +150,12 @@ inline unsigned utf8_code(const char *text, unsigned length)
     if (length <= 3)
         return code;
 
-    unsigned c3 = text[3];
+    unsigned c3 = (uint8_t) text[3];
     if (!utf8_is_next(c3))
         return code;
 
     if ((code & 0xF8) == 0xF0)
-        return ((code & 0xF)  << 18)
+        return ((code & 0x7)  << 18)
             |  ((c1   & 0x3F) << 12)
             |  ((c2   & 0x3F) << 6)
             |   (c3   & 0x3F);
@@ -152,8 +170,8 @@ inline unsigned utf8_length(const char *text, unsigned bytes)
 // ----------------------------------------------------------------------------
 {
     unsigned result = 0;
-    for (int c = *text++; bytes-- && c; c = *text++)
-        result += !utf8_is_next(c);
+    for (unsigned i = 0; i < bytes && text[i]; i++)
+        result += !utf8_is_next((uint8_t) text[i]);
     return result;
 }
 